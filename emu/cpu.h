@@ -15,6 +15,8 @@ struct cpu_state;
 struct tlb;
 int cpu_run_to_interrupt(struct cpu_state *cpu, struct tlb *tlb);
 void cpu_poke(struct cpu_state *cpu);
+// runs one block's worth of instructions without compiling them
+int cpu_interp_block(struct cpu_state *cpu, struct tlb *tlb);
 
 union mm_reg {
     qword_t qw;
@@ -17,7 +17,10 @@ static inline void do_cpuid(dword_t *eax, dword_t *ebx, dword_t *ecx, dword_t *e
         case 1:
             *eax = 0x0; // say nothing about cpu model number
             *ebx = 0x0; // processor number 0, flushes 0 bytes on clflush
-            *ecx = 0; // we support none of the features in ecx
+            *ecx = (1 << 0) // sse3
+                | (1 << 9) // ssse3
+                | (1 << 23) // popcnt
+                ;
             if(isGlibC) {
                 *edx = (1 << 0) // fpu
                 | (1 << 15) // cmov
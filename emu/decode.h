@@ -286,6 +286,47 @@ restart:
                 case 0x2f: TRACEI("comisd xmm, xmm:modrm");
                            READMODRM; V_OP(single_ucomi, xmm_modrm_val, xmm_modrm_reg,64); break;
 
+                case 0x38: READINSN; switch (insn) {
+                               case 0x00: TRACEI("pshufb xmm:modrm, xmm");
+                                          READMODRM; V_OP(shuffle_b, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x01: TRACEI("phaddw xmm:modrm, xmm");
+                                          READMODRM; V_OP(hadd_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x02: TRACEI("phaddd xmm:modrm, xmm");
+                                          READMODRM; V_OP(hadd_d, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x03: TRACEI("phaddsw xmm:modrm, xmm");
+                                          READMODRM; V_OP(hadds_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x04: TRACEI("pmaddubsw xmm:modrm, xmm");
+                                          READMODRM; V_OP(maddubs_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x05: TRACEI("phsubw xmm:modrm, xmm");
+                                          READMODRM; V_OP(hsub_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x06: TRACEI("phsubd xmm:modrm, xmm");
+                                          READMODRM; V_OP(hsub_d, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x07: TRACEI("phsubsw xmm:modrm, xmm");
+                                          READMODRM; V_OP(hsubs_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x08: TRACEI("psignb xmm:modrm, xmm");
+                                          READMODRM; V_OP(sign_b, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x09: TRACEI("psignw xmm:modrm, xmm");
+                                          READMODRM; V_OP(sign_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x0a: TRACEI("psignd xmm:modrm, xmm");
+                                          READMODRM; V_OP(sign_d, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x0b: TRACEI("pmulhrsw xmm:modrm, xmm");
+                                          READMODRM; V_OP(mulhrs_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x1c: TRACEI("pabsb xmm:modrm, xmm");
+                                          READMODRM; V_OP(abs_b, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x1d: TRACEI("pabsw xmm:modrm, xmm");
+                                          READMODRM; V_OP(abs_w, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               case 0x1e: TRACEI("pabsd xmm:modrm, xmm");
+                                          READMODRM; V_OP(abs_d, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               default: TRACEI("undefined"); UNDEFINED;
+                           }
+                           break;
+                case 0x3a: READINSN; switch (insn) {
+                               case 0x0f: TRACEI("palignr xmm:modrm, xmm, imm8");
+                                          READMODRM; READIMM8; V_OP_IMM(align_r, xmm_modrm_val, xmm_modrm_reg,128); break;
+                               default: TRACEI("undefined"); UNDEFINED;
+                           }
+                           break;
+
                 case 0x50: TRACEI("movmskpd xmm:modrm, reg");
                            READMODRM; V_OP(fmovmask_d, xmm_modrm_val, modrm_reg,128); break;
 
@@ -384,6 +425,10 @@ restart:
 
                 case 0x7e: TRACEI("movd xmm, modrm");
                            READMODRM; VMOV(xmm_modrm_reg, modrm_val,32); break;
+                case 0x7c: TRACEI("haddpd xmm:modrm, xmm");
+                           READMODRM; V_OP(hadd_pd, xmm_modrm_val, xmm_modrm_reg,128); break;
+                case 0x7d: TRACEI("hsubpd xmm:modrm, xmm");
+                           READMODRM; V_OP(hsub_pd, xmm_modrm_val, xmm_modrm_reg,128); break;
                 case 0x7f: TRACEI("movdqa xmm, xmm:modrm");
                            READMODRM; VMOV(xmm_modrm_reg, xmm_modrm_val,128); break;
 
@@ -393,6 +438,8 @@ restart:
                            READMODRM_NOMEM; READIMM8; V_OP_IMM(extract_w, xmm_modrm_val, modrm_reg,128); break;
                 case 0xc6: TRACEI("shufpd xmm:modrm, xmm, imm8");
                            READMODRM; READIMM8; V_OP_IMM(shuffle_pd, xmm_modrm_val, xmm_modrm_reg,128); break;
+                case 0xd0: TRACEI("addsubpd xmm:modrm, xmm");
+                           READMODRM; V_OP(addsub_pd, xmm_modrm_val, xmm_modrm_reg,128); break;
                 case 0xd1: TRACEI("psrlw xmm:modrm, xmm");
                            READMODRM; V_OP(shiftr_w, xmm_modrm_val, xmm_modrm_reg, 128); break;
                 case 0xd2: TRACEI("psrld xmm:modrm, xmm");
@@ -486,16 +533,30 @@ restart:
                            READMODRM; VMOV(xmm_modrm_val, xmm_modrm_reg,128); break;
                 case 0x11: TRACEI("movups xmm, xmm:modrm");
                            READMODRM; VMOV(xmm_modrm_reg, xmm_modrm_val,128); break;
-                case 0x12: TRACEI("movlps xmm, modrm");
-                           READMODRM; V_OP(movl_p, modrm_val, xmm_modrm_reg,64); break;
+                case 0x12: READMODRM;
+                           if (modrm.type == modrm_reg) {
+                               TRACEI("movhlps xmm, xmm");
+                               V_OP(movhl_ps, xmm_modrm_val, xmm_modrm_reg,128);
+                           } else {
+                               TRACEI("movlps xmm, modrm");
+                               V_OP(movl_p, modrm_val, xmm_modrm_reg,64);
+                           }
+                           break;
                 case 0x13: TRACEI("movlps modrm, xmm");
                            READMODRM; V_OP(movl_pm, xmm_modrm_reg, modrm_val,64); break;
                 case 0x14: TRACEI("unpcklps xmm, xmm:modrm");
                            READMODRM; V_OP(unpackl_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
                 case 0x15: TRACEI("unpckhps xmm, xmm:modrm");
                            READMODRM; V_OP(unpackh_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
-                case 0x16: TRACEI("movhps xmm, modrm");
-                           READMODRM; V_OP(movh_p, modrm_val, xmm_modrm_reg,64); break;
+                case 0x16: READMODRM;
+                           if (modrm.type == modrm_reg) {
+                               TRACEI("movlhps xmm, xmm");
+                               V_OP(movlh_ps, xmm_modrm_val, xmm_modrm_reg,128);
+                           } else {
+                               TRACEI("movhps xmm, modrm");
+                               V_OP(movh_p, modrm_val, xmm_modrm_reg,64);
+                           }
+                           break;
                 case 0x17: TRACEI("movhps modrm, xmm");
                            READMODRM; V_OP(movh_pm, xmm_modrm_reg, modrm_val,64); break;
                 case 0x2e: TRACEI("ucomiss xmm, xmm:modrm");
@@ -519,6 +580,47 @@ restart:
                 case 0x5c: TRACEI("subps xmm:modrm, xmm");
                            READMODRM; V_OP(sub_p, xmm_modrm_val, xmm_modrm_reg,32); break;
 
+                case 0x38: READINSN; switch (insn) {
+                               case 0x00: TRACEI("pshufb mm:modrm, mm");
+                                          READMODRM; V_OP(shuffle_b, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x01: TRACEI("phaddw mm:modrm, mm");
+                                          READMODRM; V_OP(hadd_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x02: TRACEI("phaddd mm:modrm, mm");
+                                          READMODRM; V_OP(hadd_d, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x03: TRACEI("phaddsw mm:modrm, mm");
+                                          READMODRM; V_OP(hadds_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x04: TRACEI("pmaddubsw mm:modrm, mm");
+                                          READMODRM; V_OP(maddubs_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x05: TRACEI("phsubw mm:modrm, mm");
+                                          READMODRM; V_OP(hsub_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x06: TRACEI("phsubd mm:modrm, mm");
+                                          READMODRM; V_OP(hsub_d, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x07: TRACEI("phsubsw mm:modrm, mm");
+                                          READMODRM; V_OP(hsubs_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x08: TRACEI("psignb mm:modrm, mm");
+                                          READMODRM; V_OP(sign_b, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x09: TRACEI("psignw mm:modrm, mm");
+                                          READMODRM; V_OP(sign_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x0a: TRACEI("psignd mm:modrm, mm");
+                                          READMODRM; V_OP(sign_d, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x0b: TRACEI("pmulhrsw mm:modrm, mm");
+                                          READMODRM; V_OP(mulhrs_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x1c: TRACEI("pabsb mm:modrm, mm");
+                                          READMODRM; V_OP(abs_b, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x1d: TRACEI("pabsw mm:modrm, mm");
+                                          READMODRM; V_OP(abs_w, mm_modrm_val, mm_modrm_reg,64); break;
+                               case 0x1e: TRACEI("pabsd mm:modrm, mm");
+                                          READMODRM; V_OP(abs_d, mm_modrm_val, mm_modrm_reg,64); break;
+                               default: TRACEI("undefined"); UNDEFINED;
+                           }
+                           break;
+                case 0x3a: READINSN; switch (insn) {
+                               case 0x0f: TRACEI("palignr mm:modrm, mm, imm8");
+                                          READMODRM; READIMM8; V_OP_IMM(align_r, mm_modrm_val, mm_modrm_reg,64); break;
+                               default: TRACEI("undefined"); UNDEFINED;
+                           }
+                           break;
+
                 case 0x62: TRACEI("punpckldq mm:modrm, mm");
                            READMODRM; V_OP(unpackl_dq, mm_modrm_val, mm_modrm_reg,64); break;
                 case 0x64: TRACEI("pcmpgtb mm:modrm, mm");
@@ -980,6 +1082,7 @@ restart:
                     case 0xda6: TRACE("fidiv mem32"); FIDIV(mem_addr,32); break;
                     case 0xda7: TRACE("fidivr mem32"); FIDIVR(mem_addr,32); break;
                     case 0xdb0: TRACE("fild mem32"); FILD(mem_addr,32); break;
+                    case 0xdb1: TRACE("fisttp mem32"); FISTT(mem_addr,32); FPOP; break;
                     case 0xdb2: TRACE("fist mem32"); FIST(mem_addr,32); break;
                     case 0xdb3: TRACE("fistp mem32"); FIST(mem_addr,32); FPOP; break;
                     case 0xdb5: TRACE("fld mem80"); FLDM(mem_addr_real,80); break;
@@ -993,6 +1096,7 @@ restart:
                     case 0xdc6: TRACE("fdiv mem64"); FDIVM(mem_addr_real,64); break;
                     case 0xdc7: TRACE("fdivr mem64"); FDIVRM(mem_addr_real,64); break;
                     case 0xdd0: TRACE("fld mem64"); FLDM(mem_addr_real,64); break;
+                    case 0xdd1: TRACE("fisttp mem64"); FISTT(mem_addr,64); FPOP; break;
                     case 0xdd2: TRACE("fst mem64"); FSTM(mem_addr_real,64); break;
                     case 0xdd3: TRACE("fstp mem64"); FSTM(mem_addr_real,64); FPOP; break;
                     case 0xdd4: TRACE("frstor mem32"); FRESTORE(mem_addr,32); break;
@@ -1006,6 +1110,7 @@ restart:
                     case 0xde6: TRACE("fidiv mem16"); FIDIV(mem_addr,16); break;
                     case 0xde7: TRACE("fidivr mem16"); FIDIVR(mem_addr,16); break;
                     case 0xdf0: TRACE("fild mem16"); FILD(mem_addr,16); break;
+                    case 0xdf1: TRACE("fisttp mem16"); FISTT(mem_addr,16); FPOP; break;
                     case 0xdf2: TRACE("fist mem16"); FIST(mem_addr,16); break;
                     case 0xdf3: TRACE("fistp mem16"); FIST(mem_addr,16); FPOP; break;
                     case 0xdf5: TRACE("fild mem64"); FILD(mem_addr,64); break;
@@ -1221,6 +1326,9 @@ restart:
                         case 0x11: TRACEI("movsd xmm, xmm:modrm");
                                    READMODRM; VMOV_MERGE_REG(xmm_modrm_reg, xmm_modrm_val,64); break;
 
+                        case 0x12: TRACEI("movddup xmm:modrm, xmm");
+                                   READMODRM; V_OP(dup_pd, xmm_modrm_val, xmm_modrm_reg,64); break;
+
                         case 0x2a: TRACEI("cvtsi2sd modrm, xmm");
                                    READMODRM; V_OP(cvtsi2sd, modrm_val, xmm_modrm_reg,32); break;
                         case 0x2c: TRACEI("cvttsd2si reg, xmm:modrm");
@@ -1242,13 +1350,25 @@ restart:
                                    READMODRM; V_OP(single_fdiv, xmm_modrm_val, xmm_modrm_reg,64); break;
                         case 0x5f: TRACEI("maxsd xmm:modrm, xmm");
                                    READMODRM; V_OP(single_fmax, xmm_modrm_val, xmm_modrm_reg,64); break;
+                        case 0xd6: TRACEI("movdq2q xmm, mm");
+                                   READMODRM_NOMEM; VMOV(xmm_modrm_val, mm_modrm_reg,64); break;
 
                         case 0x70: TRACEI("pshuflw xmm:modrm, xmm, imm8");
                                    READMODRM; READIMM8; V_OP_IMM(shuffle_lw, xmm_modrm_val, xmm_modrm_reg,128); break;
 
+                        case 0x7c: TRACEI("haddps xmm:modrm, xmm");
+                                   READMODRM; V_OP(hadd_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
+                        case 0x7d: TRACEI("hsubps xmm:modrm, xmm");
+                                   READMODRM; V_OP(hsub_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
+
                         case 0xc2: TRACEI("cmpsd xmm:modrm, xmm, imm8");
                                    READMODRM; READIMM8; V_OP_IMM(single_fcmp, xmm_modrm_val, xmm_modrm_reg,64); break;
 
+                        case 0xd0: TRACEI("addsubps xmm:modrm, xmm");
+                                   READMODRM; V_OP(addsub_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
+                        case 0xf0: TRACEI("lddqu modrm, xmm");
+                                   READMODRM_MEM; VMOV(xmm_modrm_val, xmm_modrm_reg,128); break;
+
                         case 0x18 ... 0x1f: TRACEI("rep nop modrm\t"); READMODRM; break;
                         default: TRACE("undefined"); UNDEFINED;
                     }
@@ -1275,6 +1395,11 @@ restart:
                         case 0x11: TRACEI("movss xmm, xmm:modrm");
                                    READMODRM; VMOV_MERGE_REG(xmm_modrm_reg, xmm_modrm_val,32); break;
 
+                        case 0x12: TRACEI("movsldup xmm:modrm, xmm");
+                                   READMODRM; V_OP(dupl_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
+                        case 0x16: TRACEI("movshdup xmm:modrm, xmm");
+                                   READMODRM; V_OP(duph_ps, xmm_modrm_val, xmm_modrm_reg,128); break;
+
                         case 0x2a: TRACEI("cvtsi2ss modrm, xmm");
                                    READMODRM; V_OP(cvtsi2ss, modrm_val, xmm_modrm_reg,32); break;
                         case 0x2c: TRACEI("cvttss2si reg, xmm:modrm");
@@ -1303,6 +1428,8 @@ restart:
 
                         case 0x7e: TRACEI("movq xmm:modrm, xmm");
                                    READMODRM; VMOV(xmm_modrm_val, xmm_modrm_reg,64); break;
+                        case 0xd6: TRACEI("movq2dq mm, xmm");
+                                   READMODRM_NOMEM; VMOV(mm_modrm_val, xmm_modrm_reg,64); break;
 
                         case 0x18 ... 0x1f: TRACEI("repz nop modrm\t"); READMODRM; break;
 
@@ -1312,6 +1439,9 @@ restart:
                         case 0x7f: TRACEI("movdqu xmm, xmm:modrm");
                                    READMODRM; VMOV(xmm_modrm_reg, xmm_modrm_val,128); break;
 
+                        case 0xb8: TRACEI("popcnt modrm, reg");
+                                   READMODRM; POPCNT(modrm_val, modrm_reg,oz); break;
+
                         // tzcnt is like bsf but the result when the input is zero is defined as the operand size
                         // for now, it can just be an alias
                         case 0xbc: TRACEI("~~tzcnt~~ bsf modrm, reg");
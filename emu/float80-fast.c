@@ -0,0 +1,142 @@
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+#include "float80.h"
+#include "misc.h"
+
+// Arithmetic on the host FPU, for -Dfpu=fast. See float80.h for how accurate
+// this is on hosts without an x87.
+
+#if defined(__x86_64__) || defined(__i386__)
+f80_native f80_to_native(float80 f) {
+    long double ld;
+    memcpy(&ld, &f, 10);
+    return ld;
+}
+float80 f80_from_native(f80_native n) {
+    float80 f = {};
+    memcpy(&f, &n, 10);
+    return f;
+}
+#define native_sqrt sqrtl
+#define native_log2 log2l
+#define native_fmod fmodl
+#define native_rint rintl
+#define native_scalbn scalbnl
+#else
+// Normal numbers that fit in a double are the only ones worth being fast for.
+// Converting the significand as an integer does the rounding, and then the
+// exponent just needs to be moved over.
+f80_native f80_to_native(float80 f) {
+    int exp = (int) f.exp - 0x3fff;
+    if (unlikely(exp < -1022 || exp > 1022 || !(f.signif & (1ul << 63))))
+        return f80_to_double(f);
+    double d = (double) f.signif;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    bits += (uint64_t) (exp - 63) << 52;
+    bits |= (uint64_t) f.sign << 63;
+    memcpy(&d, &bits, sizeof(bits));
+    return d;
+}
+float80 f80_from_native(f80_native n) {
+    uint64_t bits;
+    memcpy(&bits, &n, sizeof(bits));
+    unsigned exp = (bits >> 52) & 0x7ff;
+    if (unlikely(exp == 0 || exp == 0x7ff))
+        return f80_from_double(n);
+    float80 f = {};
+    f.signif = (bits << 11) | (1ul << 63);
+    f.exp = exp - 0x3ff + 0x3fff;
+    f.sign = bits >> 63;
+    return f;
+}
+#define native_sqrt sqrt
+#define native_log2 log2
+#define native_fmod fmod
+#define native_rint rint
+#define native_scalbn scalbn
+#endif
+
+enum native_op {
+    native_add,
+    native_sub,
+    native_mul,
+    native_div,
+    native_round,
+    native_sqrt_op,
+    native_scale,
+};
+static inline f80_native do_native_op(enum native_op op, f80_native a, f80_native b) {
+    switch (op) {
+        case native_add: return a + b;
+        case native_sub: return a - b;
+        case native_mul: return a * b;
+        case native_div: return a / b;
+        case native_round: return native_rint(a);
+        case native_sqrt_op: return native_sqrt(a);
+        case native_scale: return native_scalbn(a, (int) b);
+    }
+    __builtin_unreachable();
+}
+
+static const int host_rounding_modes[] = {
+    [round_to_nearest] = FE_TONEAREST,
+    [round_down] = FE_DOWNWARD,
+    [round_up] = FE_UPWARD,
+    [round_chop] = FE_TOWARDZERO,
+};
+
+// The volatiles keep the compiler from moving the operation outside of the
+// fesetround calls.
+static __attribute__((noinline)) f80_native native_op_rounded(enum native_op op, f80_native a, f80_native b) {
+    volatile f80_native va = a, vb = b;
+    int old_mode = fegetround();
+    fesetround(host_rounding_modes[f80_rounding_mode]);
+    volatile f80_native res = do_native_op(op, va, vb);
+    fesetround(old_mode);
+    return res;
+}
+
+// Almost everything runs with round to nearest, which is also what the host
+// is using, so only pay for switching the host mode when it's something else.
+static inline float80 native_op(enum native_op op, f80_native a, f80_native b) {
+    if (unlikely(f80_rounding_mode != round_to_nearest))
+        return f80_from_native(native_op_rounded(op, a, b));
+    return f80_from_native(do_native_op(op, a, b));
+}
+
+float80 f80_add(float80 a, float80 b) {
+    return native_op(native_add, f80_to_native(a), f80_to_native(b));
+}
+float80 f80_sub(float80 a, float80 b) {
+    return native_op(native_sub, f80_to_native(a), f80_to_native(b));
+}
+float80 f80_mul(float80 a, float80 b) {
+    return native_op(native_mul, f80_to_native(a), f80_to_native(b));
+}
+float80 f80_div(float80 a, float80 b) {
+    return native_op(native_div, f80_to_native(a), f80_to_native(b));
+}
+
+// fprem truncates the quotient, which is exactly what fmod does, and the
+// result is exact so the rounding mode doesn't matter
+float80 f80_mod(float80 x, float80 y) {
+    return f80_from_native(native_fmod(f80_to_native(x), f80_to_native(y)));
+}
+
+float80 f80_round(float80 f) {
+    return native_op(native_round, f80_to_native(f), 0);
+}
+
+float80 f80_log2(float80 x) {
+    return f80_from_native(native_log2(f80_to_native(x)));
+}
+
+float80 f80_sqrt(float80 x) {
+    return native_op(native_sqrt_op, f80_to_native(x), 0);
+}
+
+float80 f80_scale(float80 x, int scale) {
+    return native_op(native_scale, f80_to_native(x), scale);
+}
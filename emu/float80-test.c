@@ -1,8 +1,11 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <math.h>
 #include <fenv.h>
+#include <time.h>
 #include "float80.h"
 
 #pragma GCC diagnostic ignored "-Wliteral-range"
@@ -254,6 +257,103 @@ void test_compare() {
     suite_end();
 }
 
+// Not pass/fail, just numbers: how often random operands give the same bits
+// as the host, and how many ulps off the worst one was.
+static uint64_t rand_state = 0x2545f4914f6cdd1d;
+static uint64_t rand64() {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+static long double rand_f80() {
+    union f80 u = {};
+    u.f.signif = rand64() | (1ul << 63);
+    u.f.exp = 0x3fff + (int) (rand64() % 200) - 100;
+    u.f.sign = rand64() & 1;
+    return u.ld;
+}
+
+static uint64_t ulp_diff(long double actual, long double expected) {
+    if (bitwise_eq(actual, expected) || (isnan(actual) && isnan(expected)))
+        return 0;
+    if (isnan(actual) || isnan(expected) || isinf(actual) || isinf(expected) || expected == 0)
+        return UINT64_MAX;
+    return fabsl(actual - expected) / ldexpl(1, ilogbl(expected) - 63);
+}
+
+#define ACCURACY_ROUNDS 100000
+void measure_accuracy() {
+    suite_start();
+    union f80 ua, ub, u;
+#define measure(op, expr) do { \
+    int exact = 0; \
+    uint64_t worst = 0; \
+    for (int i = 0; i < ACCURACY_ROUNDS; i++) { \
+        ua.ld = rand_f80(); ub.ld = rand_f80(); \
+        u.f = f80_##op(ua.f, ub.f); \
+        long double expected = expr; \
+        uint64_t diff = ulp_diff(u.ld, expected); \
+        if (diff == 0) \
+            exact++; \
+        if (diff > worst) \
+            worst = diff; \
+    } \
+    printf("f80_"#op": %d/%d exact, worst %" PRIu64 " ulp\n", exact, ACCURACY_ROUNDS, worst); \
+} while (0)
+    measure(add, ua.ld + ub.ld);
+    measure(sub, ua.ld - ub.ld);
+    measure(mul, ua.ld * ub.ld);
+    measure(div, ua.ld / ub.ld);
+#define f80_sqrt(a, b) f80_sqrt(a)
+    measure(sqrt, sqrtl(ua.ld));
+#undef f80_sqrt
+#undef measure
+    printf("\n");
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Chains each result into the next operation so nothing gets optimized away
+// or overlapped. The operands are kept close to 1 so nothing blows up.
+#define SPEED_ROUNDS 1000000
+#define time_op(name, type, init, step) do { \
+    type x = init; \
+    double start = now(); \
+    for (int i = 0; i < SPEED_ROUNDS; i++) \
+        x = step; \
+    double elapsed = now() - start; \
+    memcpy(&gf, &x, sizeof(x)); \
+    printf("%-16s %6.1f ns/op\n", name, elapsed / SPEED_ROUNDS * 1e9); \
+} while (0)
+
+void measure_speed() {
+    union f80 one, k;
+    one.ld = 1.0000001l;
+    k.ld = 0.9999999l;
+    printf("==== measure_speed ====\n");
+    time_op("f80_add", float80, one.f, f80_add(x, k.f));
+    time_op("f80_mul", float80, one.f, f80_mul(x, k.f));
+    time_op("f80_div", float80, one.f, f80_div(x, k.f));
+    time_op("f80_sqrt", float80, one.f, f80_sqrt(f80_add(x, one.f)));
+#if FPU_FAST
+    time_op("f80_soft_add", float80, one.f, f80_soft_add(x, k.f));
+    time_op("f80_soft_mul", float80, one.f, f80_soft_mul(x, k.f));
+    time_op("f80_soft_div", float80, one.f, f80_soft_div(x, k.f));
+    time_op("f80_soft_sqrt", float80, one.f, f80_soft_sqrt(f80_soft_add(x, one.f)));
+#endif
+    volatile long double vk = k.ld, vone = one.ld;
+    time_op("host add", long double, one.ld, x + vk);
+    time_op("host mul", long double, one.ld, x * vk);
+    time_op("host div", long double, one.ld, x / vk);
+    time_op("host sqrt", long double, one.ld, sqrtl(x + vone));
+}
+#undef time_op
+
 uint64_t fnmulh(uint64_t a, uint64_t b) {
     return ((unsigned __int128) a * b) >> 64;
 }
@@ -275,6 +375,10 @@ int main() {
         test_math();
         test_compare();
     }
+    fesetround(FE_TONEAREST);
+    f80_rounding_mode = round_to_nearest;
+    measure_accuracy();
+    measure_speed();
     printf("%d/%d passed (%.0f%%)", tests_passed, tests_total, (double) tests_passed / tests_total * 100);
     return tests_passed == tests_total ? 0 : 1;
 }
@@ -3,6 +3,18 @@
 #include <string.h>
 #include <stdint.h>
 #include <math.h>
+#if FPU_FAST
+// float80-fast.c provides the real versions of these
+#define f80_add f80_soft_add
+#define f80_sub f80_soft_sub
+#define f80_mul f80_soft_mul
+#define f80_div f80_soft_div
+#define f80_mod f80_soft_mod
+#define f80_round f80_soft_round
+#define f80_log2 f80_soft_log2
+#define f80_sqrt f80_soft_sqrt
+#define f80_scale f80_soft_scale
+#endif
 #include "float80.h"
 #include "misc.h"
 
@@ -56,6 +56,35 @@ enum f80_rounding_mode {
 };
 extern __thread enum f80_rounding_mode f80_rounding_mode;
 
+#if FPU_FAST
+// With -Dfpu=fast, the arithmetic above runs on the host's FPU instead of the
+// software implementation. On x86 hosts that's the x87 with the same 80-bit
+// format, so results are what a real x87 gives. They match the software
+// implementation except for sqrt, which in software is an ulp off about one
+// time in eight (see float80-test). Everywhere else it's a double, which loses
+// 11 bits of significand and most of the exponent range: anything past about
+// 1e308 becomes infinity and anything below 1e-308 loses precision/flushes.
+#if defined(__x86_64__) || defined(__i386__)
+typedef long double f80_native;
+#else
+typedef double f80_native;
+#endif
+f80_native f80_to_native(float80 f);
+float80 f80_from_native(f80_native n);
+
+// The software implementations are still built so they can be compared
+// against in float80-test.
+float80 f80_soft_add(float80 a, float80 b);
+float80 f80_soft_sub(float80 a, float80 b);
+float80 f80_soft_mul(float80 a, float80 b);
+float80 f80_soft_div(float80 a, float80 b);
+float80 f80_soft_mod(float80 a, float80 b);
+float80 f80_soft_round(float80 f);
+float80 f80_soft_log2(float80 x);
+float80 f80_soft_sqrt(float80 x);
+float80 f80_soft_scale(float80 x, int scale);
+#endif
+
 #define F80_NAN ((float80) {.signif = 0xc000000000000000, .exp = 0x7fff, .sign = 0})
 #define F80_INF ((float80) {.signif = 0x8000000000000000, .exp = 0x7fff, .sign = 0})
 
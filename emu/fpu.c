@@ -7,6 +7,21 @@
 
 #define ST(i) cpu->fp[(cpu->top + i) % 8]
 
+#if FPU_FAST
+// host libm, at whatever precision f80_native has
+#if defined(__x86_64__) || defined(__i386__)
+#define native_exp2 exp2l
+#define native_atan2 atan2l
+#define native_sin sinl
+#define native_cos cosl
+#else
+#define native_exp2 exp2
+#define native_atan2 atan2
+#define native_sin sin
+#define native_cos cos
+#endif
+#endif
+
 static void fpu_push(struct cpu_state *cpu, float80 f) {
     cpu->top--;
     ST(0) = f;
@@ -81,6 +96,18 @@ void fpu_ist64(struct cpu_state *cpu, int64_t *i) {
     *i = f80_to_int(ST(0));
 }
 
+// fisttp always truncates, whatever the rounding mode says
+#define FPU_ISTT(size) \
+    void fpu_istt##size(struct cpu_state *cpu, int##size##_t *i) { \
+        enum f80_rounding_mode old_mode = f80_rounding_mode; \
+        f80_rounding_mode = round_chop; \
+        fpu_ist##size(cpu, i); \
+        f80_rounding_mode = old_mode; \
+    }
+FPU_ISTT(16)
+FPU_ISTT(32)
+FPU_ISTT(64)
+
 void fpu_stm32(struct cpu_state *cpu, float32 *f) {
     *f = f80_to_double(ST(0));
 }
@@ -138,10 +165,16 @@ void fpu_yl2x(struct cpu_state *cpu) {
     fpu_pop(cpu);
 }
 
+#if FPU_FAST
+void fpu_2xm1(struct cpu_state *cpu) {
+    ST(0) = f80_from_native(native_exp2(f80_to_native(ST(0))) - 1);
+}
+#else
 void fpu_2xm1(struct cpu_state *cpu) {
     // an example of the ancient chinese art of chi ting
     ST(0) = f80_from_double(pow(2, f80_to_double(ST(0))) - 1);
 }
+#endif
 
 static void fpu_comparei(struct cpu_state *cpu, float80 x) {
     cpu->zf_res = cpu->pf_res = 0;
@@ -283,6 +316,19 @@ void fpu_divrm64(struct cpu_state *cpu, float64 *f) {
     ST(0) = f80_div(f80_from_double(*f), ST(0));
 }
 
+#if FPU_FAST
+void fpu_patan(struct cpu_state *cpu) {
+    ST(1) = f80_from_native(native_atan2(f80_to_native(ST(1)), f80_to_native(ST(0))));
+    fpu_pop(cpu);
+}
+
+void fpu_sin(struct cpu_state *cpu) {
+    ST(0) = f80_from_native(native_sin(f80_to_native(ST(0))));
+}
+void fpu_cos(struct cpu_state *cpu) {
+    ST(0) = f80_from_native(native_cos(f80_to_native(ST(0))));
+}
+#else
 void fpu_patan(struct cpu_state *cpu) {
     // there's no native atan2 for 80-bit float yet.
     ST(1) = f80_from_double(atan2(f80_to_double(ST(1)), f80_to_double(ST(0))));
@@ -295,6 +341,7 @@ void fpu_sin(struct cpu_state *cpu) {
 void fpu_cos(struct cpu_state *cpu) {
     ST(0) = f80_from_double(cos(f80_to_double(ST(0))));
 }
+#endif
 
 void fpu_xtract(struct cpu_state *cpu) {
     int exp;
@@ -35,6 +35,9 @@ void fpu_st(struct cpu_state *cpu, int i);
 void fpu_ist16(struct cpu_state *cpu, int16_t *i);
 void fpu_ist32(struct cpu_state *cpu, int32_t *i);
 void fpu_ist64(struct cpu_state *cpu, int64_t *i);
+void fpu_istt16(struct cpu_state *cpu, int16_t *i);
+void fpu_istt32(struct cpu_state *cpu, int32_t *i);
+void fpu_istt64(struct cpu_state *cpu, int64_t *i);
 void fpu_stm32(struct cpu_state *cpu, float *f);
 void fpu_stm64(struct cpu_state *cpu, double *f);
 void fpu_stm80(struct cpu_state *cpu, float80 *f);
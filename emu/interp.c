@@ -1,47 +1,69 @@
+#include <time.h>
 #include "emu/cpu.h"
 #include "emu/cpuid.h"
 #include "emu/modrm.h"
-#include "emu/regid.h"
+#include "emu/tlb.h"
+#include "emu/fpu.h"
+#include "emu/vec.h"
+#include "emu/interrupt.h"
+
+// An interpreter built from the same decoder as the JIT, for code that hasn't
+// run enough times to be worth compiling. It has to leave the cpu exactly as
+// the gadgets would, since the same thread goes back and forth between the
+// two, so flags are stored the same lazy way and the helpers are shared.
+
+struct interp_state {
+    addr_t ip;
+    addr_t orig_ip;
+    bool end_block;
+};
+static int interp_step32(struct cpu_state *cpu, struct tlb *tlb, struct interp_state *state);
+static int interp_step16(struct cpu_state *cpu, struct tlb *tlb, struct interp_state *state);
 
-// TODO get rid of these
-#pragma GCC diagnostic ignored "-Wsign-compare"
-#pragma GCC diagnostic ignored "-Wtautological-constant-out-of-range-compare"
+// if an instruction accesses memory, it should do that before it modifies
+// registers, so on a segfault the instruction can be restarted from orig_ip
+#define SEGFAULT(write) do { \
+    cpu->segfault_addr = tlb->segfault_addr; \
+    cpu->segfault_was_write = write; \
+    return INT_GPF; \
+} while (0)
 
 #define DECLARE_LOCALS \
     dword_t addr_offset = 0; \
-    dword_t saved_ip = cpu->eip; \
-    struct regptr modrm_regptr, modrm_base; \
-    dword_t addr = 0; \
-    \
-    union xmm_reg xmm_src; \
-    union xmm_reg xmm_dst; \
-    \
-    float80 ftmp;
+    addr_t addr = 0
 
 #define FINISH \
-    return -1 // everything is ok.
+    cpu->eip = state->ip; \
+    return INT_NONE
 
-#define UNDEFINED { cpu->eip = saved_ip; return INT_UNDEFINED; }
+#define UNDEFINED do { return INT_UNDEFINED; } while (0)
 
-static bool modrm_compute(struct cpu_state *cpu, struct tlb *tlb, addr_t *addr_out,
-        struct modrm *modrm, struct regptr *modrm_regptr, struct regptr *modrm_base);
+static inline addr_t modrm_addr(struct cpu_state *cpu, struct modrm *modrm) {
+    if (modrm->type == modrm_reg)
+        return 0;
+    addr_t addr = modrm->offset;
+    if (modrm->base != reg_none)
+        addr += cpu->regs[modrm->base];
+    if (modrm->type == modrm_mem_si)
+        addr += cpu->regs[modrm->index] << modrm->shift;
+    return addr;
+}
 #define READMODRM \
-    if (!modrm_compute(cpu, tlb, &addr, &modrm, &modrm_regptr, &modrm_base)) { \
-        cpu->segfault_addr = cpu->eip; \
-        cpu->eip = saved_ip; \
-        return INT_GPF; \
-    }
-#define READADDR READIMM_(addr_offset, 32); addr += addr_offset
-
-#define RESTORE_IP cpu->eip = saved_ip
-#define _READIMM(name,size) \
-    name = mem_read(cpu->eip, size); \
-    cpu->eip += size/8
-
-#define TRACEIP() TRACE("%d %08x\t", current->pid, cpu->eip);
-
+    if (!modrm_decode32(&state->ip, tlb, &modrm)) \
+        SEGFAULT(false); \
+    addr += modrm_addr(cpu, &modrm)
+#define READADDR _READIMM(addr_offset, 32); addr += addr_offset
 #define SEG_GS() addr += cpu->tls_ptr
 
+#define RESTORE_IP state->ip = state->orig_ip
+#define _READIMM(name, size) do { \
+    uint(size) _imm; \
+    if (!tlb_read(tlb, state->ip, &_imm, size/8)) \
+        SEGFAULT(false); \
+    name = _imm; \
+    state->ip += size/8; \
+} while (0)
+
 // this is a completely insane way to turn empty into OP_SIZE and any other size into itself
 #define sz(x) sz_##x
 #define sz_ OP_SIZE
@@ -51,439 +73,565 @@ static bool modrm_compute(struct cpu_state *cpu, struct tlb *tlb, addr_t *addr_o
 #define sz_64 64
 #define sz_80 80
 #define sz_128 128
-#define twice(x) glue(twice_, x)
-#define twice_8 16
-#define twice_16 32
-#define twice_32 64
-
-// types for different sizes
-#define ty(x) ty_##x
-#define ty_8 uint8_t
-#define ty_16 uint16_t
-#define ty_32 uint32_t
-#define ty_64 uint64_t
-#define ty_128 union xmm_reg
-
-#define mem_read_ts(addr, type, size) ({ \
-    type val; \
-    if (!tlb_read(tlb, addr, &val, size/8)) { \
-        cpu->eip = saved_ip; \
-        cpu->segfault_addr = addr; \
-        return INT_GPF; \
-    } \
-    val; \
-})
-#define mem_write_ts(addr, val, type, size) ({ \
-    type _val = val; \
-    if (!tlb_write(tlb, addr, &_val, size/8)) { \
-        cpu->eip = saved_ip; \
-        cpu->segfault_addr = addr; \
-        return INT_GPF; \
-    } \
-})
-#define mem_read(addr, size) mem_read_ts(addr, ty(size), size)
-#define mem_write(addr, val, size) mem_write_ts(addr, val, ty(size), size)
 
-#define get(what, size) get_##what(sz(size))
-#define set(what, to, size) set_##what(to, sz(size))
-#define is_memory(what) is_memory_##what
+#define mem_read(a, z) ({ \
+    uint(z) _rval; \
+    if (!tlb_read(tlb, a, &_rval, z/8)) \
+        SEGFAULT(false); \
+    _rval; \
+})
+#define mem_write(a, val, z) do { \
+    uint(z) _wval = val; \
+    if (!tlb_write(tlb, a, &_wval, z/8)) \
+        SEGFAULT(true); \
+} while (0)
 
-#define REGISTER(regptr, size) (*(ty(size) *) (((char *) cpu) + (regptr).reg##size##_id))
+// 8 bit registers 4-7 are the high bytes of the first four
+static inline void *reg_ptr(struct cpu_state *cpu, enum reg32 reg, int size) {
+    if (size == 8 && reg >= reg_esp)
+        return (char *) &cpu->regs[reg - reg_esp] + 1;
+    return &cpu->regs[reg];
+}
+#define GPR(reg, z) (*(uint(z) *) reg_ptr(cpu, reg, z))
 
-#define get_modrm_reg(size) REGISTER(modrm_regptr, size)
-#define set_modrm_reg(to, size) REGISTER(modrm_regptr, size) = to
-#define is_memory_modrm_reg 0
+#define get(what, z) get_##what(sz(z))
+#define set(what, to, z) set_##what(to, sz(z))
+#define is_memory(what) is_memory_##what
 
+#define get_modrm_reg(z) GPR(modrm.reg, z)
+#define set_modrm_reg(to, z) GPR(modrm.reg, z) = to
+#define get_modrm_val(z) \
+    (modrm.type == modrm_reg ? GPR(modrm.base, z) : mem_read(addr, z))
+#define set_modrm_val(to, z) do { \
+    if (modrm.type == modrm_reg) \
+        GPR(modrm.base, z) = to; \
+    else \
+        mem_write(addr, to, z); \
+} while (0)
 #define is_memory_modrm_val (modrm.type != modrm_reg)
-#define get_modrm_val(size) \
-    (modrm.type == modrm_reg ? \
-     REGISTER(modrm_base, size) : \
-     mem_read(addr, size))
-
-#define set_modrm_val(to, size) \
-    if (modrm.type == modrm_reg) { \
-        REGISTER(modrm_base, size) = to; \
-    } else { \
-        mem_write(addr, to, size); \
-    }(void)0
-
-#define get_imm(size) ((uint(size)) imm)
-
-#define get_mem_addr(size) mem_read(addr, size)
-#define set_mem_addr(to, size) mem_write(addr, to, size)
-
-#define get_mem_si(size) mem_read(cpu->esi, size)
-#define set_mem_si(size) mem_write(cpu->esi, size)
-#define get_mem_di(size) mem_read(cpu->edi, size)
-#define set_mem_di(size) mem_write(cpu->esi, size)
-
-// DEFINE ALL THE MACROS
-#define get_reg_a(size) ((uint(size)) cpu->eax)
-#define get_reg_b(size) ((uint(size)) cpu->ebx)
-#define get_reg_c(size) ((uint(size)) cpu->ecx)
-#define get_reg_d(size) ((uint(size)) cpu->edx)
-#define get_reg_si(size) ((uint(size)) cpu->esi)
-#define get_reg_di(size) ((uint(size)) cpu->edi)
-#define get_reg_bp(size) ((uint(size)) cpu->ebp)
-#define get_reg_sp(size) ((uint(size)) cpu->esp)
-#define get_eip(size) cpu->eip
-#define get_eflags(size) cpu->eflags
-#define get_gs(size) cpu->gs
-#define set_reg_a(to, size) *(uint(size) *) &cpu->eax = to
-#define set_reg_b(to, size) *(uint(size) *) &cpu->ebx = to
-#define set_reg_c(to, size) *(uint(size) *) &cpu->ecx = to
-#define set_reg_d(to, size) *(uint(size) *) &cpu->edx = to
-#define set_reg_si(to, size) *(uint(size) *) &cpu->esi = to
-#define set_reg_di(to, size) *(uint(size) *) &cpu->edi = to
-#define set_reg_bp(to, size) *(uint(size) *) &cpu->ebp = to
-#define set_reg_sp(to, size) *(uint(size) *) &cpu->esp = to
-#define set_eip(to, size) cpu->eip = to
-#define set_eflags(to, size) cpu->eflags = to
-#define set_gs(to, size) cpu->gs = to
-
-#define get_0(size) 0
-#define get_1(size) 1
 
+#define get_reg_a(z) GPR(reg_eax, z)
+#define get_reg_c(z) GPR(reg_ecx, z)
+#define get_reg_d(z) GPR(reg_edx, z)
+#define get_reg_b(z) GPR(reg_ebx, z)
+#define get_reg_sp(z) GPR(reg_esp, z)
+#define get_reg_bp(z) GPR(reg_ebp, z)
+#define get_reg_si(z) GPR(reg_esi, z)
+#define get_reg_di(z) GPR(reg_edi, z)
+#define set_reg_a(to, z) GPR(reg_eax, z) = to
+#define set_reg_c(to, z) GPR(reg_ecx, z) = to
+#define set_reg_d(to, z) GPR(reg_edx, z) = to
+#define set_reg_b(to, z) GPR(reg_ebx, z) = to
+#define set_reg_sp(to, z) GPR(reg_esp, z) = to
+#define set_reg_bp(to, z) GPR(reg_ebp, z) = to
+#define set_reg_si(to, z) GPR(reg_esi, z) = to
+#define set_reg_di(to, z) GPR(reg_edi, z) = to
+#define is_memory_reg_a 0
+#define is_memory_reg_c 0
+#define is_memory_reg_d 0
+#define is_memory_reg_b 0
+#define is_memory_reg_sp 0
+#define is_memory_reg_bp 0
+#define is_memory_reg_si 0
+#define is_memory_reg_di 0
+
+#define get_eflags(z) ((uint(z)) cpu->eflags)
+#define set_eflags(to, z) \
+    cpu->eflags = (cpu->eflags & ~(dword_t) (uint(z)) -1) | (uint(z)) (to)
+#define is_memory_eflags 0
+#define get_gs(z) cpu->gs
+#define set_gs(to, z) cpu->gs = to
+
+#define get_imm(z) ((uint(z)) imm)
+#define get_1(z) 1
 // only used by lea
-#define get_addr(size) addr
-
-// INSTRUCTION MACROS
-// if an instruction accesses memory, it should do that before it modifies
-// registers, so segfault recovery only needs to save IP.
-
-// takes any unsigned integer and casts it to signed of the same size
-
-#define unsigned_overflow(what, a, b, res, z) ({ \
-    int ov = __builtin_##what##_overflow((uint(z)) (a), (uint(z)) (b), (uint(z) *) &res); \
-    res = (sint(z)) res; ov; \
-})
-#define signed_overflow(what, a, b, res, z) ({ \
-    int ov = __builtin_##what##_overflow((sint(z)) (a), (sint(z)) (b), (sint(z) *) &res); \
-    res = (sint(z)) res; ov; \
-})
+#define get_addr(z) addr
+#define get_mem_addr(z) mem_read(addr, z)
+#define set_mem_addr(to, z) mem_write(addr, to, z)
+#define get_mem_si(z) mem_read(cpu->esi, z)
+#define set_mem_si(to, z) mem_write(cpu->esi, to, z)
+#define get_mem_di(z) mem_read(cpu->edi, z)
+#define set_mem_di(to, z) mem_write(cpu->edi, to, z)
 
 #define MOV(src, dst,z) \
     set(dst, get(src,z),z)
 #define MOVZX(src, dst, zs, zd) \
     set(dst, get(src,zs),zd)
 #define MOVSX(src, dst, zs, zd) \
-    set(dst, (uint(sz(zd))) (sint(sz(zs))) get(src,zs),zd)
+    set(dst, (uint(zd)) (sint(zs)) get(src,zs),zd)
 
-#define XCHG(src, dst,z) do { \
-    dword_t tmp = get(src,z); \
-    set(src, get(dst,z),z); \
-    set(dst, tmp,z); \
-} while (0)
-
-#define PUSH(thing,z) \
-    mem_write(cpu->esp - OP_SIZE/8, get(thing,z),z); \
-    cpu->esp -= OP_SIZE/8
-#define POP(thing,z) \
-    set(thing, mem_read(cpu->esp, z),z); \
-    cpu->esp += OP_SIZE/8
+// flags, stored the same way the gadgets do. The arithmetic instructions
+// work on _s and _d, the source and destination operands, and leave the
+// result in _r.
 
-#define INT(code) \
-    return get(code,8)
+#define SETRES(result,z) \
+    cpu->res = (int32_t) (sint(z)) (result); \
+    cpu->zf_res = cpu->sf_res = cpu->pf_res = 1
+#define arith_flags(z) \
+    cpu->op1 = _s; cpu->op2 = _d; cpu->af_ops = 1; \
+    SETRES(_r,z)
+#define add_of(z) \
+    cpu->of = ((~(_s ^ _d) & (_d ^ _r)) >> (z - 1)) & 1
+#define sub_of(z) \
+    cpu->of = (((_s ^ _d) & (_d ^ _r)) >> (z - 1)) & 1
+#define add_flags(carry,z) \
+    cpu->cf = ((uint64_t) _d + _s + (carry)) >> z; \
+    add_of(z); arith_flags(z)
+#define sub_flags(borrow,z) \
+    cpu->cf = (((uint64_t) _d - _s - (borrow)) >> z) & 1; \
+    sub_of(z); arith_flags(z)
+#define logic_flags(z) \
+    cpu->cf = cpu->of = 0; \
+    cpu->af = cpu->af_ops = 0; \
+    SETRES(_r,z)
+
+#define ARITH(src, dst,z, calc, flags, store) do { \
+    uint(z) _s = get(src,z); \
+    uint(z) _d = get(dst,z); \
+    uint(z) _r = calc; \
+    if (store) \
+        set(dst, _r,z); \
+    flags; \
+} while (0)
 
-// math
+#define ADD(src, dst,z) ARITH(src, dst,z, _d + _s, add_flags(0,z), true)
+#define ADC(src, dst,z) do { \
+    byte_t _c = cpu->cf; \
+    ARITH(src, dst,z, _d + _s + _c, add_flags(_c,z), true); \
+} while (0)
+#define SUB(src, dst,z) ARITH(src, dst,z, _d - _s, sub_flags(0,z), true)
+#define SBB(src, dst,z) do { \
+    byte_t _c = cpu->cf; \
+    ARITH(src, dst,z, _d - _s - _c, sub_flags(_c,z), true); \
+} while (0)
+#define CMP(src, dst,z) ARITH(src, dst,z, _d - _s, sub_flags(0,z), false)
+#define AND(src, dst,z) ARITH(src, dst,z, _d & _s, logic_flags(z), true)
+#define OR(src, dst,z) ARITH(src, dst,z, _d | _s, logic_flags(z), true)
+#define XOR(src, dst,z) ARITH(src, dst,z, _d ^ _s, logic_flags(z), true)
+#define TEST(src, dst,z) ARITH(src, dst,z, _d & _s, logic_flags(z), false)
+// inc and dec leave cf alone
+#define INC(val,z) ARITH(1, val,z, _d + _s, add_of(z); arith_flags(z), true)
+#define DEC(val,z) ARITH(1, val,z, _d - _s, sub_of(z); arith_flags(z), true)
+#define NOT(val,z) set(val, ~get(val,z),z)
+#define NEG(val,z) do { \
+    uint(z) _s = get(val,z); \
+    uint(z) _d = 0; \
+    uint(z) _r = -_s; \
+    set(val, _r,z); \
+    cpu->cf = _s != 0; \
+    sub_of(z); arith_flags(z); \
+} while (0)
 
-#define SETRESFLAGS cpu->zf_res = cpu->sf_res = cpu->pf_res = 1
-#define SETRES_RAW(result,z)
-#define SETRES(result,z) \
-    cpu->res = (int32_t) (sint(z)) (result); SETRESFLAGS
-    // ^ sign extend result so SF is correct
-#define ZEROAF cpu->af = cpu->af_ops = 0
-#define SETAF(a, b,z) \
-    cpu->op1 = get(a,z); cpu->op2 = get(b,z); cpu->af_ops = 1
-
-#define TEST(src, dst,z) \
-    SETRES(get(dst,z) & get(src,z),z); \
-    cpu->cf = cpu->of = cpu->af = cpu->af_ops = 0
-
-#define ADD(src, dst,z) \
-    SETAF(src, dst,z); \
-    cpu->cf = unsigned_overflow(add, get(dst,z), get(src,z), cpu->res,z); \
-    cpu->of = signed_overflow(add, get(dst,z), get(src,z), cpu->res,z); \
-    set(dst, cpu->res,z); SETRESFLAGS
-
-#define ADC(src, dst,z) \
-    SETAF(src, dst,z); \
-    cpu->of = signed_overflow(add, get(dst,z), get(src,z) + cpu->cf, cpu->res,z) \
-        || (cpu->cf && get(src,z) == ((uint(z)) -1) / 2); \
-    cpu->cf = unsigned_overflow(add, get(dst,z), get(src,z) + cpu->cf, cpu->res,z) \
-        || (cpu->cf && get(src,z) == (uint(z)) -1); \
-    set(dst, cpu->res,z); SETRESFLAGS
-
-#define SBB(src, dst,z) \
-    SETAF(src, dst,z); \
-    cpu->of = signed_overflow(sub, get(dst,z), get(src,z) + cpu->cf, cpu->res,z) \
-        || (cpu->cf && get(src,z) == ((uint(z)) -1) / 2); \
-    cpu->cf = unsigned_overflow(sub, get(dst,z), get(src,z) + cpu->cf, cpu->res,z) \
-        || (cpu->cf && get(src,z) == (uint(z)) -1); \
-    set(dst, cpu->res,z); SETRESFLAGS
-
-#define OR(src, dst,z) \
-    set(dst, get(dst,z) | get(src,z),z); \
-    cpu->cf = cpu->of = cpu->af = cpu->af_ops = 0; SETRES(get(dst,z),z)
-
-#define AND(src, dst,z) \
-    set(dst, get(dst,z) & get(src,z),z); \
-    cpu->cf = cpu->of = cpu->af = cpu->af_ops = 0; SETRES(get(dst,z),z)
-
-#define SUB(src, dst,z) \
-    SETAF(src, dst,z); \
-    cpu->of = signed_overflow(sub, get(dst,z), get(src,z), cpu->res,z); \
-    cpu->cf = unsigned_overflow(sub, get(dst,z), get(src,z), cpu->res,z); \
-    set(dst, cpu->res,z); SETRESFLAGS
-
-#define XOR(src, dst,z) \
-    set(dst, get(dst,z) ^ get(src,z),z); \
-    cpu->cf = cpu->of = cpu->af = cpu->af_ops = 0; SETRES(get(dst,z),z)
-
-#define CMP(src, dst,z) \
-    SETAF(src, dst,z); \
-    cpu->cf = unsigned_overflow(sub, get(dst,z), get(src,z), cpu->res,z); \
-    cpu->of = signed_overflow(sub, get(dst,z), get(src,z), cpu->res,z); \
-    SETRESFLAGS
-
-#define INC(val,z) do { \
-    int tmp = cpu->cf; \
-    ADD(1, val,z); \
-    cpu->cf = tmp; \
-} while (0)
-#define DEC(val,z) do { \
-    int tmp = cpu->cf; \
-    SUB(1, val,z); \
-    cpu->cf = tmp; \
-} while (0)
-
-#define MUL18(val) cpu->ax = cpu->al * val
+// multiplication and division only change cf and of
 #define MUL1(val,z) do { \
-    uint64_t tmp = get(reg_a,z) * (uint64_t) get(val,z); \
-    set(reg_a, tmp,z); set(reg_d, tmp >> z,z);; \
-    cpu->cf = cpu->of = (tmp != (uint32_t) tmp); ZEROAF; \
-    cpu->zf = cpu->sf = cpu->pf = cpu->zf_res = cpu->sf_res = cpu->pf_res = 0; \
+    uint64_t _r = (uint64_t) get(reg_a,z) * get(val,z); \
+    if (z == 8) { \
+        cpu->ax = _r; \
+    } else { \
+        set(reg_a, _r,z); \
+        set(reg_d, _r >> z,z); \
+    } \
+    cpu->cf = cpu->of = (_r >> z) != 0; \
 } while (0)
 #define IMUL1(val,z) do { \
-    int64_t tmp = (int64_t) (sint(z)) get(reg_a,z) * (sint(z)) get(val,z); \
-    set(reg_a, tmp,z); set(reg_d, tmp >> z,z); \
-    cpu->cf = cpu->of = (tmp != (int32_t) tmp); \
-    cpu->zf = cpu->sf = cpu->pf = cpu->zf_res = cpu->sf_res = cpu->pf_res = 0; \
-} while (0)
-#define IMUL2(val, reg,z) \
-    cpu->cf = cpu->of = signed_overflow(mul, get(reg,z), get(val,z), cpu->res,z); \
-    set(reg, cpu->res,z); SETRESFLAGS
-#define IMUL3(imm, src, dst,z) \
-    cpu->cf = cpu->of = signed_overflow(mul, get(src,z), get(imm,z), cpu->res,z); \
-    set(dst, cpu->res,z); \
-    cpu->pf_res = 1; cpu->zf = cpu->sf = cpu->zf_res = cpu->sf_res = 0
-
+    int64_t _r = (int64_t) (sint(z)) get(reg_a,z) * (sint(z)) get(val,z); \
+    if (z == 8) { \
+        cpu->ax = _r; \
+    } else { \
+        set(reg_a, _r,z); \
+        set(reg_d, (uint64_t) _r >> z,z); \
+    } \
+    cpu->cf = cpu->of = _r != (sint(z)) _r; \
+} while (0)
+#define IMUL3(times, src, dst,z) do { \
+    int64_t _r = (int64_t) (sint(z)) get(src,z) * (sint(z)) get(times,z); \
+    set(dst, _r,z); \
+    cpu->cf = cpu->of = _r != (sint(z)) _r; \
+} while (0)
+#define IMUL2(val, reg,z) IMUL3(val, reg, reg,z)
+
+// the dividend is twice the operand size, in ax for 8 bit and d:a otherwise
+#define dividend(z) \
+    (z == 8 ? cpu->ax : (uint64_t) get(reg_d,z) << z | get(reg_a,z))
+#define div_result(quot, rem,z) \
+    if (z == 8) { \
+        cpu->al = quot; \
+        cpu->ah = rem; \
+    } else { \
+        set(reg_a, quot,z); \
+        set(reg_d, rem,z); \
+    }
 #define DIV(val,z) do { \
-    if (get(val,z) == 0) return INT_DIV; \
-    uint(twice(z)) dividend = get(reg_a,z) | ((uint(twice(z))) get(reg_d,z) << z); \
-    set(reg_d, dividend % get(val,z),z); \
-    set(reg_a, dividend / get(val,z),z); \
+    uint(z) _div = get(val,z); \
+    if (_div == 0) \
+        return INT_DIV; \
+    uint64_t _n = dividend(z); \
+    uint64_t _q = _n / _div; \
+    if (_q >> z) \
+        return INT_DIV; \
+    div_result(_q, _n % _div,z); \
 } while (0)
-
 #define IDIV(val,z) do { \
-    if (get(val,z) == 0) return INT_DIV; \
-    sint(twice(z)) dividend = get(reg_a,z) | ((sint(twice(z))) get(reg_d,z) << z); \
-    set(reg_d, dividend % get(val,z),z); \
-    set(reg_a, dividend / get(val,z),z); \
+    sint(z) _div = get(val,z); \
+    if (_div == 0) \
+        return INT_DIV; \
+    int64_t _n = (int64_t) (dividend(z) << (64 - 2 * z)) >> (64 - 2 * z); \
+    if (_div == -1 && _n == INT64_MIN) \
+        return INT_DIV; \
+    int64_t _q = _n / _div; \
+    if (_q != (sint(z)) _q) \
+        return INT_DIV; \
+    div_result(_q, _n % _div,z); \
 } while (0)
 
-// TODO this is probably wrong in some subtle way
-#define HALF_OP_SIZE glue(HALF_, OP_SIZE)
-#define HALF_16 8
-#define HALF_32 16
+#define half(z) glue(half_, z)
+#define half_16 8
+#define half_32 16
 #define CVT \
-    set(reg_d, get(reg_a,oz) & (1 << (oz - 1)) ? (uint(oz)) -1 : 0, oz)
+    set(reg_d, (sint(oz)) get(reg_a,oz) < 0 ? -1 : 0,oz)
 #define CVTE \
-    REG_VAL(cpu, REG_ID(eax), HALF_OP_SIZE) = (sint(OP_SIZE)) REG_VAL(cpu, REG_ID(ax), OP_SIZE)
-
-#define CALL(loc) PUSH(eip,oz); JMP(loc)
-#define CALL_REL(offset) PUSH(eip,oz); JMP_REL(offset)
-
-#define ROL(count, val,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        /* the compiler miraculously turns this into a rol instruction with optimizations on */\
-        set(val, get(val,z) << cnt | get(val,z) >> (z - cnt),z); \
-        cpu->cf = get(val,z) & 1; \
-        if (cnt == 1) { cpu->of = cpu->cf ^ (get(val,z) >> (OP_SIZE - 1)); } \
-    }
-#define ROR(count, val,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        set(val, get(val,z) >> cnt | get(val,z) << (z - cnt),z); \
-        cpu->cf = get(val,z) >> (OP_SIZE - 1); \
-        if (cnt == 1) { cpu->of = cpu->cf ^ (get(val,z) & 1); } \
-    }
-#define SHL(count, val,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        cpu->cf = (get(val,z) << (cnt - 1)) >> (z - 1); \
-        cpu->of = cpu->cf ^ (get(val,z) >> (z - 1)); \
-        set(val, get(val,z) << cnt,z); SETRES(get(val,z),z); ZEROAF; \
-    }
-#define SHR(count, val,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        cpu->cf = (get(val,z) >> (cnt - 1)) & 1; \
-        cpu->of = get(val,z) >> (z - 1); \
-        set(val, get(val,z) >> cnt,z); SETRES(get(val,z),z); ZEROAF; \
-    }
-#define SAR(count, val,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        cpu->cf = (get(val,z) >> (cnt - 1)) & 1; cpu->of = 0; \
-        set(val, ((sint(z)) get(val,z)) >> cnt,z); SETRES(get(val,z),z); ZEROAF; \
-    }
-
-#define SHRD(count, extra, dst,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        cpu->cf = (get(dst,z) >> (cnt - 1)) & 1; \
-        cpu->res = get(dst,z) >> cnt | get(extra,z) << (z - cnt); \
-        set(dst, cpu->res,z); \
-        SETRESFLAGS; \
-    }
-
-#define RCR(count, val,z) UNDEFINED
-#define RCL(count, val,z) UNDEFINED
-
-#define SHLD(count, extra, dst,z) \
-    if (get(count,8) % z != 0) { \
-        int cnt = get(count,8) % z; \
-        cpu->res = get(dst,z) << cnt | get(extra,z) >> (z - cnt); \
-        set(dst, cpu->res,z); \
-        SETRESFLAGS; \
-    }
+    set(reg_a, (sint(half(OP_SIZE))) get(reg_a,half(OP_SIZE)),oz)
+
+// shifts and rotates mask the count with 31 and do nothing if that's 0
+#define SHIFT(count, val,z, calc) do { \
+    unsigned _cnt = get(count,8) & 31; \
+    if (_cnt == 0) \
+        break; \
+    uint(z) _v = get(val,z); \
+    calc \
+} while (0)
 
-#define NOT(val,z) \
-    set(val, ~get(val,z),z) // TODO flags
-#define NEG(val,z) \
-    SETAF(0, val,z); \
-    cpu->of = signed_overflow(sub, 0, get(val,z), cpu->res,z); \
-    cpu->cf = unsigned_overflow(sub, 0, get(val,z), cpu->res,z); \
-    set(val, cpu->res,z); SETRESFLAGS; break; \
-
-#define GRP38(val) \
-    switch (modrm.opcode) { \
-        case 0: \
-        case 1: TRACE("test imm"); \
-                READIMM8; TEST(imm, val); break; \
-        case 2: TRACE("not"); return INT_UNDEFINED; \
-        case 3: TRACE("neg"); return INT_UNDEFINED; \
-        case 4: TRACE("mul"); return INT_UNDEFINED; \
-        case 5: TRACE("imul"); return INT_UNDEFINED; \
-        case 6: TRACE("div"); \
-                DIV(cpu->al, modrm_val8, cpu->ah); break; \
-        case 7: TRACE("idiv"); \
-                IDIV(oax, modrm_val, odx); break; \
-        default: TRACE("undefined"); return INT_UNDEFINED; \
-    }
+#define SHL(count, val,z) SHIFT(count, val,z, \
+    uint64_t _wide = (uint64_t) _v << _cnt; \
+    uint(z) _r = _wide; \
+    set(val, _r,z); \
+    cpu->cf = (_wide >> z) & 1; \
+    cpu->of = ((_r >> (z - 1)) & 1) ^ cpu->cf; \
+    SETRES(_r,z); cpu->af = cpu->af_ops = 0;)
+#define SHR(count, val,z) SHIFT(count, val,z, \
+    uint(z) _r = (uint64_t) _v >> _cnt; \
+    set(val, _r,z); \
+    cpu->cf = ((uint64_t) _v >> (_cnt - 1)) & 1; \
+    cpu->of = (_v >> (z - 1)) & 1; \
+    SETRES(_r,z); cpu->af = cpu->af_ops = 0;)
+#define SAR(count, val,z) SHIFT(count, val,z, \
+    int64_t _sv = (sint(z)) _v; \
+    uint(z) _r = _sv >> _cnt; \
+    set(val, _r,z); \
+    cpu->cf = (_sv >> (_cnt - 1)) & 1; \
+    cpu->of = 0; \
+    SETRES(_r,z); cpu->af = cpu->af_ops = 0;)
+
+#define ROL(count, val,z) SHIFT(count, val,z, \
+    unsigned _n = _cnt % z; \
+    uint(z) _r = _n ? _v << _n | _v >> (z - _n) : _v; \
+    set(val, _r,z); \
+    cpu->cf = _r & 1; \
+    cpu->of = ((_r >> (z - 1)) ^ _r) & 1;)
+#define ROR(count, val,z) SHIFT(count, val,z, \
+    unsigned _n = _cnt % z; \
+    uint(z) _r = _n ? _v >> _n | _v << (z - _n) : _v; \
+    set(val, _r,z); \
+    cpu->cf = (_r >> (z - 1)) & 1; \
+    cpu->of = ((_r >> (z - 1)) ^ (_r >> (z - 2))) & 1;)
+// rcl and rcr rotate z + 1 bits, with cf on top
+#define RCL(count, val,z) SHIFT(count, val,z, \
+    unsigned _n = _cnt % (z + 1); \
+    uint64_t _wide = (uint64_t) cpu->cf << z | _v; \
+    if (_n) \
+        _wide = (_wide << _n | _wide >> (z + 1 - _n)) & ((2ull << z) - 1); \
+    uint(z) _r = _wide; \
+    set(val, _r,z); \
+    cpu->cf = (_wide >> z) & 1; \
+    cpu->of = ((_r >> (z - 1)) & 1) ^ cpu->cf;)
+#define RCR(count, val,z) SHIFT(count, val,z, \
+    unsigned _n = _cnt % (z + 1); \
+    uint64_t _wide = (uint64_t) cpu->cf << z | _v; \
+    if (_n) \
+        _wide = (_wide >> _n | _wide << (z + 1 - _n)) & ((2ull << z) - 1); \
+    uint(z) _r = _wide; \
+    set(val, _r,z); \
+    cpu->cf = (_wide >> z) & 1; \
+    cpu->of = ((_r >> (z - 1)) ^ (_r >> (z - 2))) & 1;)
+
+#define SHLD(count, extra, dst,z) SHIFT(count, dst,z, \
+    uint64_t _wide = (uint64_t) _v << z | get(extra,z); \
+    uint(z) _r = (_wide << _cnt) >> z; \
+    set(dst, _r,z); \
+    cpu->cf = (_wide >> (2 * z - _cnt)) & 1; \
+    cpu->of = ((_r ^ _v) >> (z - 1)) & 1; \
+    SETRES(_r,z);)
+#define SHRD(count, extra, dst,z) SHIFT(count, dst,z, \
+    uint64_t _wide = (uint64_t) get(extra,z) << z | _v; \
+    uint(z) _r = _wide >> _cnt; \
+    set(dst, _r,z); \
+    cpu->cf = (_wide >> (_cnt - 1)) & 1; \
+    cpu->of = ((_r ^ _v) >> (z - 1)) & 1; \
+    SETRES(_r,z);)
 
 // bits
 
-#define get_bit(bit, val,z) \
-    ((is_memory(val) ? \
-      mem_read(addr + get(bit,z) / z * (z/8), z) : \
-      get(val,z)) & (1 << (get(bit,z) % z))) ? 1 : 0
-
-#define msk(bit,z) (1 << (get(bit,z) % z))
-
-#define BT(bit, val,z) \
-    cpu->cf = get_bit(bit, val,z);
-
-#define BTC(bit, val,z) \
-    BT(bit, val,z); \
-    set(val, get(val,z) ^ msk(bit,z),z)
+// A register bit offset can reach outside of a memory operand, in either
+// direction. An immediate one is masked to the operand size.
+#define bit_imm_imm 1
+#define bit_imm_modrm_reg 0
+#define BIT_OP(bit, val,z, calc, write) do { \
+    uint(z) _bit = get(bit,z); \
+    if (bit_imm_##bit) \
+        _bit &= z - 1; \
+    uint(z) _mask = (uint(z)) 1 << (_bit & (z - 1)); \
+    addr_t _bit_addr = addr + (((sint(z)) _bit >> 3) & ~(z/8 - 1)); \
+    uint(z) _v = modrm.type == modrm_reg ? get(val,z) : mem_read(_bit_addr, z); \
+    if (write) { \
+        if (modrm.type == modrm_reg) \
+            set(val, calc,z); \
+        else \
+            mem_write(_bit_addr, calc,z); \
+    } \
+    cpu->cf = (_v & _mask) != 0; \
+} while (0)
+#define BT(bit, val,z) BIT_OP(bit, val,z, _v, false)
+#define BTC(bit, val,z) BIT_OP(bit, val,z, _v ^ _mask, true)
+#define BTS(bit, val,z) BIT_OP(bit, val,z, _v | _mask, true)
+#define BTR(bit, val,z) BIT_OP(bit, val,z, _v & ~_mask, true)
+
+// bsf and bsr only set zf
+#define BSF(src, dst,z) do { \
+    uint(z) _v = get(src,z); \
+    if (_v != 0) \
+        set(dst, __builtin_ctz(_v),z); \
+    cpu->zf = _v == 0; \
+    cpu->zf_res = 0; \
+} while (0)
+#define BSR(src, dst,z) do { \
+    uint(z) _v = get(src,z); \
+    if (_v != 0) \
+        set(dst, 31 - __builtin_clz(_v),z); \
+    cpu->zf = _v == 0; \
+    cpu->zf_res = 0; \
+} while (0)
+#define POPCNT(src, dst,z) do { \
+    uint(z) _v = get(src,z); \
+    set(dst, __builtin_popcount(_v),z); \
+    cpu->cf = cpu->of = 0; \
+    cpu->af = cpu->af_ops = 0; \
+    cpu->zf = _v == 0; \
+    cpu->sf = cpu->pf = 0; \
+    cpu->zf_res = cpu->sf_res = cpu->pf_res = 0; \
+} while (0)
 
-#define BTS(bit, val,z) \
-    BT(bit, val,z); \
-    set(val, get(val,z) | msk(bit,z),z)
+#define BSWAP(dst) \
+    set(dst, __builtin_bswap32(get(dst,32)),32)
 
-#define BTR(bit, val,z) \
-    BT(bit, val,z); \
-    set(val, get(val,z) & ~msk(bit,z),z)
+// xchg with memory is always atomic, see atomic_ptr
+#define XCHG(src, dst,z) do { \
+    uint(z) *_ptr = is_memory(dst) ? atomic_ptr(addr, z) : NULL; \
+    uint(z) _s = get(src,z); \
+    uint(z) _d; \
+    if (_ptr != NULL) { \
+        _d = __atomic_exchange_n(_ptr, _s, __ATOMIC_SEQ_CST); \
+    } else { \
+        _d = get(dst,z); \
+        set(dst, _s,z); \
+    } \
+    set(src, _d,z); \
+} while (0)
+#define is_memory_modrm_reg 0
 
-#define BSF(src, dst,z) \
-    cpu->zf = get(src,z) == 0; \
-    cpu->zf_res = 0; \
-    if (!cpu->zf) set(dst, __builtin_ctz(get(src,z)),z)
+// dst is set last so xadd of a register with itself ends up with the sum
+#define XADD(src, dst,z) do { \
+    uint(z) _s = get(src,z); \
+    uint(z) _d = get(dst,z); \
+    uint(z) _r = _d + _s; \
+    set(src, _d,z); \
+    set(dst, _r,z); \
+    add_flags(0,z); \
+} while (0)
 
-#define BSR(src, dst,z) \
-    cpu->zf = get(src,z) == 0; \
+// cmpxchg sets the flags like cmp of the accumulator and the destination
+#define CMPXCHG(src, dst,z) do { \
+    uint(z) _s = get(dst,z); \
+    uint(z) _d = get(reg_a,z); \
+    uint(z) _r = _d - _s; \
+    if (_r == 0) \
+        set(dst, get(src,z),z); \
+    else \
+        set(reg_a, _s,z); \
+    sub_flags(0,z); \
+} while (0)
+#define CMPXCHG8B(dst,z) do { \
+    uint64_t _v = mem_read(addr, 64); \
+    bool _equal = _v == ((uint64_t) cpu->edx << 32 | cpu->eax); \
+    if (_equal) { \
+        mem_write(addr, (uint64_t) cpu->ecx << 32 | cpu->ebx, 64); \
+    } else { \
+        cpu->eax = _v; \
+        cpu->edx = _v >> 32; \
+    } \
+    cpu->zf = _equal; \
     cpu->zf_res = 0; \
-    if (!cpu->zf) set(dst, z - __builtin_clz(get(src,z)),z)
-
-// string instructions
+} while (0)
 
-#define BUMP_SI(size) \
-    if (!cpu->df) \
-        cpu->esi += sz(size)/8; \
-    else \
-        cpu->esi -= sz(size)/8
-#define BUMP_DI(size) \
-    if (!cpu->df) \
-        cpu->edi += sz(size)/8; \
-    else \
-        cpu->edi -= sz(size)/8
-#define BUMP_SI_DI(size) \
-    BUMP_SI(size); BUMP_DI(size)
-
-#define str_movs(z) \
-    mem_write(cpu->edi, mem_read(cpu->esi, z), z); \
-    BUMP_SI_DI(z)
-#define str_stos(z) \
-    mem_write(cpu->edi, get(reg_a,z),z); \
-    BUMP_DI(z)
-#define str_lods(z) \
-    set(reg_a, mem_read(cpu->esi, z),z); \
-    BUMP_SI(z)
-#define str_scas(z) \
-    CMP(reg_a, mem_di,z); \
-    BUMP_DI(z)
-#define str_cmps(z) \
-    CMP(mem_di, mem_si,z); \
-    BUMP_SI_DI(z)
+// atomics
 
-#define STR(op, z) str_##op(z)
+// Host pointer for a locked access to guest memory, or NULL if it crosses
+// into the next page, which the gadgets don't do atomically either.
+#define atomic_ptr(a, z) ({ \
+    uint(z) *_aptr = NULL; \
+    if (PGOFFSET(a) <= PAGE_SIZE - z/8) { \
+        _aptr = __tlb_write_ptr(tlb, a); \
+        if (_aptr == NULL) \
+            SEGFAULT(true); \
+    } \
+    _aptr; \
+})
 
-#define REP(op, z) \
-    while (cpu->ecx != 0) { \
-        STR(op, z); \
-        cpu->ecx--; \
-    }
+#define ATOMIC_ARITH(src, dst,z, calc, flags) do { \
+    uint(z) *_ptr = atomic_ptr(addr, z); \
+    if (_ptr == NULL) { \
+        ARITH(src, dst,z, calc, flags, true); \
+        break; \
+    } \
+    uint(z) _s = get(src,z); \
+    uint(z) _d = __atomic_load_n(_ptr, __ATOMIC_RELAXED); \
+    uint(z) _r; \
+    do { \
+        _r = calc; \
+    } while (!__atomic_compare_exchange_n(_ptr, &_d, _r, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)); \
+    flags; \
+} while (0)
+#define ATOMIC_ADD(src, dst,z) ATOMIC_ARITH(src, dst,z, _d + _s, add_flags(0,z))
+#define ATOMIC_ADC(src, dst,z) do { \
+    byte_t _c = cpu->cf; \
+    ATOMIC_ARITH(src, dst,z, _d + _s + _c, add_flags(_c,z)); \
+} while (0)
+#define ATOMIC_SUB(src, dst,z) ATOMIC_ARITH(src, dst,z, _d - _s, sub_flags(0,z))
+#define ATOMIC_SBB(src, dst,z) do { \
+    byte_t _c = cpu->cf; \
+    ATOMIC_ARITH(src, dst,z, _d - _s - _c, sub_flags(_c,z)); \
+} while (0)
+#define ATOMIC_AND(src, dst,z) ATOMIC_ARITH(src, dst,z, _d & _s, logic_flags(z))
+#define ATOMIC_OR(src, dst,z) ATOMIC_ARITH(src, dst,z, _d | _s, logic_flags(z))
+#define ATOMIC_XOR(src, dst,z) ATOMIC_ARITH(src, dst,z, _d ^ _s, logic_flags(z))
+#define ATOMIC_INC(val,z) ATOMIC_ARITH(1, val,z, _d + _s, add_of(z); arith_flags(z))
+#define ATOMIC_DEC(val,z) ATOMIC_ARITH(1, val,z, _d - _s, sub_of(z); arith_flags(z))
+
+#define ATOMIC_XADD(src, dst,z) do { \
+    uint(z) *_ptr = atomic_ptr(addr, z); \
+    if (_ptr == NULL) { \
+        XADD(src, dst,z); \
+        break; \
+    } \
+    uint(z) _s = get(src,z); \
+    uint(z) _d = __atomic_fetch_add(_ptr, _s, __ATOMIC_SEQ_CST); \
+    uint(z) _r = _d + _s; \
+    set(src, _d,z); \
+    add_flags(0,z); \
+} while (0)
 
-#define REPNZ(op, z) \
-    while (cpu->ecx != 0) { \
-        STR(op, z); \
-        cpu->ecx--; \
-        if (ZF) break; \
-    }
+#define ATOMIC_CMPXCHG(src, dst,z) do { \
+    uint(z) *_ptr = atomic_ptr(addr, z); \
+    if (_ptr == NULL) { \
+        CMPXCHG(src, dst,z); \
+        break; \
+    } \
+    uint(z) _d = get(reg_a,z); \
+    uint(z) _s = _d; \
+    if (!__atomic_compare_exchange_n(_ptr, &_s, get(src,z), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) \
+        set(reg_a, _s,z); \
+    uint(z) _r = _d - _s; \
+    sub_flags(0,z); \
+} while (0)
+#define ATOMIC_CMPXCHG8B(dst,z) do { \
+    uint64_t *_ptr = atomic_ptr(addr, 64); \
+    if (_ptr == NULL) { \
+        CMPXCHG8B(dst,z); \
+        break; \
+    } \
+    uint64_t _v = (uint64_t) cpu->edx << 32 | cpu->eax; \
+    bool _equal = __atomic_compare_exchange_n(_ptr, &_v, (uint64_t) cpu->ecx << 32 | cpu->ebx, \
+            false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+    if (!_equal) { \
+        cpu->eax = _v; \
+        cpu->edx = _v >> 32; \
+    } \
+    cpu->zf = _equal; \
+    cpu->zf_res = 0; \
+} while (0)
 
-#define REPZ(op, z) \
-    while (cpu->ecx != 0) { \
-        STR(op, z); \
-        cpu->ecx--; \
-        if (!ZF) break; \
-    }
+#define ATOMIC_BIT_OP(bit, val,z, op, fallback) do { \
+    uint(z) _bit = get(bit,z); \
+    if (bit_imm_##bit) \
+        _bit &= z - 1; \
+    addr_t _bit_addr = addr + (((sint(z)) _bit >> 3) & ~(z/8 - 1)); \
+    uint(z) *_ptr = modrm.type == modrm_reg ? NULL : atomic_ptr(_bit_addr, z); \
+    if (_ptr == NULL) { \
+        fallback(bit, val,z); \
+        break; \
+    } \
+    uint(z) _mask = (uint(z)) 1 << (_bit & (z - 1)); \
+    cpu->cf = (op(_ptr, _mask) & _mask) != 0; \
+} while (0)
+#define atomic_btc(ptr, mask) __atomic_fetch_xor(ptr, mask, __ATOMIC_SEQ_CST)
+#define atomic_bts(ptr, mask) __atomic_fetch_or(ptr, mask, __ATOMIC_SEQ_CST)
+#define atomic_btr(ptr, mask) __atomic_fetch_and(ptr, ~mask, __ATOMIC_SEQ_CST)
+#define ATOMIC_BTC(bit, val,z) ATOMIC_BIT_OP(bit, val,z, atomic_btc, BTC)
+#define ATOMIC_BTS(bit, val,z) ATOMIC_BIT_OP(bit, val,z, atomic_bts, BTS)
+#define ATOMIC_BTR(bit, val,z) ATOMIC_BIT_OP(bit, val,z, atomic_btr, BTR)
+
+// stack
+
+#define PUSH(thing,z) do { \
+    uint(z) _v = get(thing,z); \
+    mem_write(cpu->esp - z/8, _v,z); \
+    cpu->esp -= z/8; \
+} while (0)
+// popping into memory addressed with esp uses esp after the pop
+#define POP(thing,z) do { \
+    uint(z) _v = mem_read(cpu->esp, z); \
+    if (is_memory(thing)) { \
+        if (modrm.base == reg_esp) \
+            addr += z/8; \
+        set(thing, _v,z); \
+        cpu->esp += z/8; \
+    } else { \
+        cpu->esp += z/8; \
+        set(thing, _v,z); \
+    } \
+} while (0)
 
-#define CMPXCHG(src, dst,z) \
-    CMP(reg_a, dst,z); \
-    if (E) { \
-        MOV(src, dst,z); \
-    } else \
-        MOV(dst, reg_a,z)
+// control transfer
 
-#define XADD(src, dst,z) \
-    XCHG(src, dst,z); \
-    ADD(src, dst,z)
+#define JUMP(to) do { \
+    state->ip = to; \
+    state->end_block = true; \
+} while (0)
+#define JMP(loc) JUMP(get(loc,))
+#define JMP_REL(off) JUMP(state->ip + (sint(oz)) get(off,))
+#define J_REL(cond, off) JUMP(cond ? state->ip + (sint(oz)) get(off,) : state->ip)
+#define JN_REL(cond, off) J_REL(!(cond), off)
+#define JCXZ_REL(off) J_REL(cpu->ecx == 0, off)
+
+#define CALL(loc) do { \
+    addr_t _target = get(loc,); \
+    PUSH(eip,oz); \
+    JUMP(_target); \
+} while (0)
+#define CALL_REL(off) do { \
+    PUSH(eip,oz); \
+    JUMP(state->ip + (sint(oz)) get(off,)); \
+} while (0)
+#define get_eip(z) state->ip
+#define RET_NEAR(imm) do { \
+    addr_t _target = mem_read(cpu->esp, 32); \
+    cpu->esp += 4 + (uint16_t) (imm); \
+    JUMP(_target); \
+} while (0)
 
-#define BSWAP(dst) \
-    set(dst, __builtin_bswap32(get(dst,32)),32)
+#define INT(code) do { \
+    cpu->eip = state->ip; \
+    return (uint8_t) code; \
+} while (0)
 
 // condition codes
 #define E ZF
@@ -495,86 +643,316 @@ static bool modrm_compute(struct cpu_state *cpu, struct tlb *tlb, addr_t *addr_o
 #define P PF
 #define S SF
 
-// control transfer
-
-#define FIX_EIP \
-    if (OP_SIZE == 16) \
-        cpu->eip &= 0xffff
-
-#define JMP(loc) cpu->eip = get(loc,); FIX_EIP;
-#define JMP_REL(offset) cpu->eip += get(offset,); FIX_EIP;
-#define J_REL(cond, offset) \
-    if (cond) { \
-        cpu->eip += get(offset,); FIX_EIP; \
-    }
-#define JN_REL(cond, offset) \
-    if (!cond) { \
-        cpu->eip += get(offset,); FIX_EIP; \
-    }
-#define JCXZ_REL(offset) J_REL(get(reg_c,oz) == 0, offset)
-
-#define RET_NEAR(imm) POP(eip,32); FIX_EIP; cpu->esp += get(imm,16)
-
 #define SET(cond, val) \
-    set(val, (cond ? 1 : 0),8)
+    set(val, (cond) ? 1 : 0,8)
 #define SETN(cond, val) \
-    set(val, (cond ? 0 : 1),8)
-
-#define CMOV(cond, dst, src,z) if (cond) MOV(dst, src,z)
-#define CMOVN(cond, dst, src,z) if (!cond) MOV(dst, src,z)
-
-#define POPF() \
-    POP(eflags,32); \
-    expand_flags(cpu)
+    set(val, (cond) ? 0 : 1,8)
+#define CMOV(cond, src, dst,z) \
+    if (cond) MOV(src, dst,z)
+#define CMOVN(cond, src, dst,z) \
+    if (!(cond)) MOV(src, dst,z)
 
 #define PUSHF() \
     collapse_flags(cpu); \
     PUSH(eflags,oz)
-
-#define STD cpu->df = 1
-#define CLD cpu->df = 0
+#define POPF() \
+    POP(eflags,oz); \
+    expand_flags(cpu)
 
 #define AH_FLAG_MASK 0b11010101
 #define SAHF \
-    cpu->eflags &= 0xffffff00 | ~AH_FLAG_MASK; \
-    cpu->eflags |= cpu->ah & AH_FLAG_MASK; \
+    collapse_flags(cpu); \
+    cpu->eflags = (cpu->eflags & ~AH_FLAG_MASK) | (cpu->ah & AH_FLAG_MASK); \
     expand_flags(cpu)
 
-#define RDTSC \
-    imm = rdtsc(); \
-    cpu->eax = imm & 0xffffffff; \
-    cpu->edx = imm >> 32
+#define STD cpu->df = 1
+#define CLD cpu->df = 0
+
+// same clock as helper_rdtsc
+#define RDTSC do { \
+    struct timespec _now; \
+    clock_gettime(CLOCK_MONOTONIC, &_now); \
+    uint64_t _tsc = _now.tv_sec * 1000000000l + _now.tv_nsec; \
+    cpu->eax = _tsc & 0xffffffff; \
+    cpu->edx = _tsc >> 32; \
+} while (0)
 
 #define CPUID() \
     do_cpuid(&cpu->eax, &cpu->ebx, &cpu->ecx, &cpu->edx)
 
-// atomic
-#define ATOMIC_ADD ADD
-#define ATOMIC_OR OR
-#define ATOMIC_ADC ADC
-#define ATOMIC_SBB SBB
-#define ATOMIC_AND AND
-#define ATOMIC_SUB SUB
-#define ATOMIC_XOR XOR
-#define ATOMIC_INC INC
-#define ATOMIC_DEC DEC
-#define ATOMIC_CMPXCHG CMPXCHG
-#define ATOMIC_XADD XADD
-#define ATOMIC_BTS BTS
-#define ATOMIC_BTR BTR
-#define ATOMIC_BTC BTC
-
-#include "emu/interp/fpu.h"
-
-// fake sse
-#define VLOAD(src, dst,z) UNDEFINED
-#define VSTORE(src, dst,z) UNDEFINED
+// string instructions
+
+#define BUMP(reg,z) \
+    cpu->reg += cpu->df ? -(z/8) : z/8
+
+#define str_movs(z) do { \
+    uint(z) _v = mem_read(cpu->esi, z); \
+    mem_write(cpu->edi, _v,z); \
+    BUMP(esi,z); BUMP(edi,z); \
+} while (0)
+#define str_stos(z) do { \
+    mem_write(cpu->edi, get(reg_a,z),z); \
+    BUMP(edi,z); \
+} while (0)
+#define str_lods(z) do { \
+    set(reg_a, mem_read(cpu->esi, z),z); \
+    BUMP(esi,z); \
+} while (0)
+#define str_scas(z) do { \
+    CMP(mem_di, reg_a,z); \
+    BUMP(edi,z); \
+} while (0)
+#define str_cmps(z) do { \
+    CMP(mem_di, mem_si,z); \
+    BUMP(esi,z); BUMP(edi,z); \
+} while (0)
+
+// the bulk versions in jit/helpers.c, if they're there
+#if ENGINE_JIT
+void helper_rep_movs(struct cpu_state *cpu, struct tlb *tlb, unsigned size);
+void helper_rep_stos(struct cpu_state *cpu, struct tlb *tlb, unsigned size);
+void helper_rep_scas(struct cpu_state *cpu, struct tlb *tlb, unsigned size, bool repnz);
+void helper_rep_cmps(struct cpu_state *cpu, struct tlb *tlb, unsigned size, bool repnz);
+#define REP_BULK_MIN 16
+#define rep_bulk(call) \
+    if (!cpu->df && cpu->ecx >= REP_BULK_MIN) call
+#define rep_bulk_movs(z, repnz) rep_bulk(helper_rep_movs(cpu, tlb, z/8))
+#define rep_bulk_stos(z, repnz) rep_bulk(helper_rep_stos(cpu, tlb, z/8))
+#define rep_bulk_scas(z, repnz) rep_bulk(helper_rep_scas(cpu, tlb, z/8, repnz))
+#define rep_bulk_cmps(z, repnz) rep_bulk(helper_rep_cmps(cpu, tlb, z/8, repnz))
+#else
+#define rep_bulk_movs(z, repnz)
+#define rep_bulk_stos(z, repnz)
+#define rep_bulk_scas(z, repnz)
+#define rep_bulk_cmps(z, repnz)
+#endif
+#define rep_bulk_lods(z, repnz)
+
+#define STR(op, z) str_##op(z)
+#define REP(op, z) do { \
+    rep_bulk_##op(z, false); \
+    while (cpu->ecx != 0) { \
+        STR(op, z); \
+        cpu->ecx--; \
+    } \
+} while (0)
+#define REPZ(op, z) do { \
+    rep_bulk_##op(z, false); \
+    while (cpu->ecx != 0) { \
+        STR(op, z); \
+        cpu->ecx--; \
+        if (!ZF) break; \
+    } \
+} while (0)
+#define REPNZ(op, z) do { \
+    rep_bulk_##op(z, true); \
+    while (cpu->ecx != 0) { \
+        STR(op, z); \
+        cpu->ecx--; \
+        if (ZF) break; \
+    } \
+} while (0)
+
+// fpu
+
+#define st_0 0
+#define st_i modrm.rm_opcode
+// memory operands go through a buffer
+#define fpu_read(helper, size) do { \
+    _Alignas(16) char _buf[size]; \
+    if (!tlb_read(tlb, addr, _buf, size)) \
+        SEGFAULT(false); \
+    helper(cpu, (void *) _buf); \
+} while (0)
+#define fpu_write(helper, size) do { \
+    _Alignas(16) char _buf[size]; \
+    helper(cpu, (void *) _buf); \
+    if (!tlb_write(tlb, addr, _buf, size)) \
+        SEGFAULT(true); \
+} while (0)
+#define FPU_ENV_SIZE 28
+#define FPU_STATE_SIZE 108
+
+#define FLD() fpu_ld(cpu, st_i)
+#define FILD(val,z) fpu_read(fpu_ild##z, z/8)
+#define FLDM(val,z) fpu_read(fpu_ldm##z, z/8)
+#define FSTM(dst,z) fpu_write(fpu_stm##z, z/8)
+#define FIST(dst,z) fpu_write(fpu_ist##z, z/8)
+#define FISTT(dst,z) fpu_write(fpu_istt##z, z/8)
+#define FXCH() fpu_xch(cpu, st_i)
+#define FCOM() fpu_com(cpu, st_i)
+#define FCOMM(val,z) fpu_read(fpu_comm##z, z/8)
+#define FICOM(val,z) fpu_read(fpu_icom##z, z/8)
+#define FUCOM() fpu_ucom(cpu, st_i)
+#define FUCOMI() fpu_ucomi(cpu, st_i)
+#define FCOMI() fpu_comi(cpu, st_i)
+#define FTST() fpu_tst(cpu)
+#define FXAM() fpu_xam(cpu)
+#define FST() fpu_st(cpu, st_i)
+#define FCHS() fpu_chs(cpu)
+#define FABS() fpu_abs(cpu)
+#define FLDC(what) fpu_ldc(cpu, fconst_##what)
+#define FPREM() fpu_prem(cpu)
+#define FRNDINT() fpu_rndint(cpu)
+#define FSCALE() fpu_scale(cpu)
+#define FSQRT() fpu_sqrt(cpu)
+#define FYL2X() fpu_yl2x(cpu)
+#define F2XM1() fpu_2xm1(cpu)
+#define FSTSW(dst) set(dst, cpu->fsw,16)
+#define FSTCW(dst) fpu_write(fpu_stcw16, 2)
+#define FLDCW(dst) fpu_read(fpu_ldcw16, 2)
+#define FSTENV(val,z) fpu_write(fpu_stenv32, FPU_ENV_SIZE)
+#define FLDENV(val,z) fpu_read(fpu_ldenv32, FPU_ENV_SIZE)
+#define FSAVE(val,z) fpu_write(fpu_save32, FPU_STATE_SIZE)
+#define FRESTORE(val,z) fpu_read(fpu_restore32, FPU_STATE_SIZE)
+#define FCLEX() fpu_clex(cpu)
+#define FPOP fpu_pop(cpu)
+#define FINCSTP() fpu_incstp(cpu)
+#define FADD(src, dst) fpu_add(cpu, src, dst)
+#define FIADD(val,z) fpu_read(fpu_iadd##z, z/8)
+#define FADDM(val,z) fpu_read(fpu_addm##z, z/8)
+#define FSUB(src, dst) fpu_sub(cpu, src, dst)
+#define FSUBM(val,z) fpu_read(fpu_subm##z, z/8)
+#define FISUB(val,z) fpu_read(fpu_isub##z, z/8)
+#define FISUBR(val,z) fpu_read(fpu_isubr##z, z/8)
+#define FSUBR(src, dst) fpu_subr(cpu, src, dst)
+#define FSUBRM(val,z) fpu_read(fpu_subrm##z, z/8)
+#define FMUL(src, dst) fpu_mul(cpu, src, dst)
+#define FIMUL(val,z) fpu_read(fpu_imul##z, z/8)
+#define FMULM(val,z) fpu_read(fpu_mulm##z, z/8)
+#define FDIV(src, dst) fpu_div(cpu, src, dst)
+#define FIDIV(val,z) fpu_read(fpu_idiv##z, z/8)
+#define FDIVM(val,z) fpu_read(fpu_divm##z, z/8)
+#define FDIVR(src, dst) fpu_divr(cpu, src, dst)
+#define FIDIVR(val,z) fpu_read(fpu_idivr##z, z/8)
+#define FDIVRM(val,z) fpu_read(fpu_divrm##z, z/8)
+#define FPATAN() fpu_patan(cpu)
+#define FSIN() fpu_sin(cpu)
+#define FCOS() fpu_cos(cpu)
+#define FXTRACT() fpu_xtract(cpu)
+#define FCMOVB(src) fpu_cmovb(cpu, src)
+#define FCMOVE(src) fpu_cmove(cpu, src)
+#define FCMOVBE(src) fpu_cmovbe(cpu, src)
+#define FCMOVU(src) fpu_cmovu(cpu, src)
+#define FCMOVNB(src) fpu_cmovnb(cpu, src)
+#define FCMOVNE(src) fpu_cmovne(cpu, src)
+#define FCMOVNBE(src) fpu_cmovnbe(cpu, src)
+#define FCMOVNU(src) fpu_cmovnu(cpu, src)
+
+// vector
+
+enum vec_arg {
+    vec_arg_imm,
+    vec_arg_modrm_reg, vec_arg_modrm_val,
+    vec_arg_mm_modrm_reg, vec_arg_mm_modrm_val,
+    vec_arg_xmm_modrm_reg, vec_arg_xmm_modrm_val,
+};
+
+static inline bool vec_could_be_memory(enum vec_arg arg) {
+    return arg == vec_arg_modrm_val || arg == vec_arg_mm_modrm_val || arg == vec_arg_xmm_modrm_val;
+}
+
+static inline void *vec_reg_ptr(struct cpu_state *cpu, enum vec_arg arg, int index) {
+    switch (arg) {
+        case vec_arg_xmm_modrm_reg: case vec_arg_xmm_modrm_val:
+            return &cpu->xmm[index];
+        case vec_arg_mm_modrm_reg: case vec_arg_mm_modrm_val:
+            return &cpu->mm[index];
+        case vec_arg_modrm_reg: case vec_arg_modrm_val:
+            return &cpu->regs[index];
+        default:
+            return NULL;
+    }
+}
+
+// Picks the operands the same way as gen_vec. The helpers take src, dst, and
+// an immediate that the ones which don't want it ignore.
+static int interp_vec(struct cpu_state *cpu, struct tlb *tlb, enum vec_arg src, enum vec_arg dst,
+        void (*helper)(), struct modrm *modrm, addr_t addr, uint8_t imm, unsigned size) {
+    void (*op)(struct cpu_state *, const void *, void *, uint8_t) = (void *) helper;
+    bool rm_is_src = !vec_could_be_memory(dst);
+    enum vec_arg rm = rm_is_src ? src : dst;
+    enum vec_arg reg = rm_is_src ? dst : src;
+    void *reg_ptr = vec_reg_ptr(cpu, reg, modrm->opcode);
+
+    if (rm == vec_arg_imm) {
+        // This is rm_opcode instead of opcode because PSRLQ is weird like that
+        void (*imm_op)(struct cpu_state *, uint8_t, void *) = (void *) helper;
+        imm_op(cpu, imm, vec_reg_ptr(cpu, reg, modrm->rm_opcode));
+        return INT_NONE;
+    }
+    if (!vec_could_be_memory(rm) || modrm->type == modrm_reg) {
+        void *rm_ptr = vec_reg_ptr(cpu, rm, modrm->rm_opcode);
+        if (rm_is_src)
+            op(cpu, rm_ptr, reg_ptr, imm);
+        else
+            op(cpu, reg_ptr, rm_ptr, imm);
+        return INT_NONE;
+    }
+
+    // Like the gadgets, only the first size bits are checked, and the helper
+    // gets a pointer straight into the page unless that crosses into the next
+    // one.
+    void *ptr = NULL;
+    union xmm_reg buf;
+    if (PGOFFSET(addr) <= PAGE_SIZE - size / 8) {
+        ptr = rm_is_src ? __tlb_read_ptr(tlb, addr) : __tlb_write_ptr(tlb, addr);
+        if (ptr == NULL)
+            goto segfault;
+    } else {
+        ptr = &buf;
+        if (!tlb_read(tlb, addr, &buf, size / 8))
+            goto segfault;
+    }
+    if (rm_is_src)
+        op(cpu, ptr, reg_ptr, imm);
+    else
+        op(cpu, reg_ptr, ptr, imm);
+    if (ptr == &buf && !rm_is_src && !tlb_write(tlb, addr, &buf, size / 8))
+        goto segfault;
+    return INT_NONE;
+
+segfault:
+    cpu->segfault_addr = tlb->segfault_addr;
+    cpu->segfault_was_write = !rm_is_src;
+    return INT_GPF;
+}
+
+#define V_OP(op, src, dst,z) vec_op(op, src, dst,z)
+#define V_OP_IMM(op, src, dst,z) vec_op(op, src, dst,z)
+#define vec_op(op, src, dst,z) do { \
+    int _interrupt = interp_vec(cpu, tlb, vec_arg_##src, vec_arg_##dst, \
+            (void (*)()) vec_##op##z, &modrm, addr, imm, z); \
+    if (_interrupt != INT_NONE) \
+        return _interrupt; \
+} while (0)
+
+#define vec_dst_size_modrm_val 32
+#define vec_dst_size_mm_modrm_val 64
+#define vec_dst_size_mm_modrm_reg 64
+#define vec_dst_size_xmm_modrm_val 128
+#define vec_dst_size_xmm_modrm_reg 128
+// you always want to merge when storing to memory
+// default is to never merge otherwise
+#define VMOV(src, dst,z) \
+    if (vec_could_be_memory(vec_arg_##dst) && modrm.type != modrm_reg) { \
+        V_OP(merge, src, dst,z); \
+    } else { \
+        V_OP(glue3(zero, vec_dst_size_##dst, _copy), src, dst,z); \
+    }
+// this will additionally merge if both src and dst are registers, e.g. movss
+#define VMOV_MERGE_REG(src, dst,z) \
+    if (modrm.type == modrm_reg || vec_could_be_memory(vec_arg_##dst)) { \
+        V_OP(merge, src, dst,z); \
+    } else { \
+        V_OP(glue3(zero, vec_dst_size_##dst, _copy), src, dst,z); \
+    }
 
 // ok now include the decoding function
-#define DECODER_RET int
-#define DECODER_NAME cpu_step
-#define DECODER_ARGS struct cpu_state *cpu, struct tlb *tlb
-#define DECODER_PASS_ARGS cpu, tlb
+#define DECODER_RET static int
+#define DECODER_NAME interp_step
+#define DECODER_ARGS struct cpu_state *cpu, struct tlb *tlb, struct interp_state *state
+#define DECODER_PASS_ARGS cpu, tlb, state
 
 #define OP_SIZE 32
 #include "emu/decode.h"
@@ -583,50 +961,45 @@ static bool modrm_compute(struct cpu_state *cpu, struct tlb *tlb, addr_t *addr_o
 #include "emu/decode.h"
 #undef OP_SIZE
 
-// reads a modrm and maybe sib byte, computes the address, and adds it to
-// *addr_out, returns false if segfault while reading the bytes
-static bool modrm_compute(struct cpu_state *cpu, struct tlb *tlb, addr_t *addr_out,
-        struct modrm *modrm, struct regptr *modrm_regptr, struct regptr *modrm_base) {
-    if (!modrm_decode32(&cpu->eip, tlb, modrm))
-        return false;
-    *modrm_regptr = regptr_from_reg(modrm->reg);
-    *modrm_base = regptr_from_reg(modrm->base);
-    if (modrm->type == modrm_reg)
-        return true;
-
-    if (modrm->base != reg_none)
-        *addr_out += REGISTER(*modrm_base, 32);
-    *addr_out += modrm->offset;
-    if (modrm->type == modrm_mem_si) {
-        struct regptr index_reg = regptr_from_reg(modrm->index);
-        *addr_out += REGISTER(index_reg, 32) << modrm->shift;
+// Runs up to where the JIT would have ended a block starting here, so blocks
+// get counted the same whichever one runs them.
+int cpu_interp_block(struct cpu_state *cpu, struct tlb *tlb) {
+    struct interp_state state = {.ip = cpu->eip};
+    addr_t start = state.ip;
+    while (!state.end_block && state.ip - start < PAGE_SIZE - 15) {
+        state.orig_ip = state.ip;
+        int interrupt = interp_step32(cpu, tlb, &state);
+        if (interrupt != INT_NONE)
+            return interrupt;
     }
-    return true;
+    return INT_NONE;
 }
 
-flatten __no_instrument void cpu_run(struct cpu_state *cpu) {
-    int i = 0;
-    struct tlb tlb = {.mem = cpu->mem};
-    tlb_flush(&tlb);
-    read_lock(&cpu->mem->lock, __FILE__, __LINE__);
-    int changes = cpu->mem->changes;
-    while (true) {
-        int interrupt = cpu_step32(cpu, &tlb);
-        if (interrupt == INT_NONE && i++ >= 100000) {
-            i = 0;
+#if !ENGINE_JIT
+int cpu_run_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
+    if (cpu->poked_ptr == NULL)
+        cpu->poked_ptr = &cpu->_poked;
+    tlb_refresh(tlb, cpu->mmu);
+
+    int interrupt = INT_NONE;
+    if (cpu->tf) {
+        struct interp_state state = {.ip = cpu->eip, .orig_ip = cpu->eip};
+        interrupt = interp_step32(cpu, tlb, &state);
+        if (interrupt == INT_NONE)
+            interrupt = INT_DEBUG;
+    }
+    while (interrupt == INT_NONE) {
+        interrupt = cpu_interp_block(cpu, tlb);
+        if (interrupt == INT_NONE && __atomic_exchange_n(cpu->poked_ptr, false, __ATOMIC_SEQ_CST))
+            interrupt = INT_TIMER;
+        if (interrupt == INT_NONE && ++cpu->cycle % (1 << 10) == 0)
             interrupt = INT_TIMER;
-        }
-        if (interrupt != INT_NONE) {
-            cpu->trapno = interrupt;
-            read_unlock(&cpu->mem->lock, __FILE__, __LINE__);
-            handle_interrupt(interrupt);
-            read_lock(&cpu->mem->lock, __FILE__, __LINE__);
-            if (tlb.mem != cpu->mem)
-                tlb.mem = cpu->mem;
-            if (cpu->mem->changes != changes) {
-                tlb_flush(&tlb);
-                changes = cpu->mem->changes;
-            }
-        }
     }
+    cpu->trapno = interrupt;
+    return interrupt;
+}
+
+void cpu_poke(struct cpu_state *cpu) {
+    __atomic_store_n(cpu->poked_ptr, true, __ATOMIC_SEQ_CST);
 }
+#endif
@@ -210,6 +210,9 @@ int pt_unmap(struct mem *mem, page_t start, pages_t pages) {
 }
 
 int pt_unmap_always(struct mem *mem, page_t start, pages_t pages) {
+#if ENGINE_JIT
+    jit_invalidate_range(mem->mmu.jit, start, start + pages);
+#endif
     for (page_t page = start; page < start + pages; mem_next_page(mem, &page)) {
         while(critical_region_count(current) >3) {
             nanosleep(&lock_pause, NULL);
@@ -217,9 +220,6 @@ int pt_unmap_always(struct mem *mem, page_t start, pages_t pages) {
         struct pt_entry *pt = mem_pt(mem, page);
         if (pt == NULL)
             continue;
-#if ENGINE_JIT
-        jit_invalidate_page(mem->mmu.jit, page);
-#endif
         struct data *data = pt->data;
         mem_pt_del(mem, page);
         if (--data->refcount == 0) {
@@ -50,6 +50,12 @@ struct data {
     struct fd *fd;
     size_t file_offset;
     const char *name;
+#if ENGINE_JIT
+    // translation cache file for fd, found on first use
+    struct jit_disk_file *jit_disk_file;
+    // symbols of fd for perf maps, also found on first use
+    struct jit_perf_file *jit_perf_file;
+#endif
 #if LEAK_DEBUG
     int pid;
     addr_t dest;
@@ -60,7 +66,11 @@ struct pt_entry {
     size_t offset;
     unsigned flags;
 #if ENGINE_JIT
+    // jit blocks with their first byte in this page, and ones running into
+    // it from the previous page
     struct list blocks[2];
+    // bumped whenever blocks here are invalidated, see jit_block_get
+    uint64_t jit_invalidations;
 #endif
 };
 // page flags
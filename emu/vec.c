@@ -568,6 +568,12 @@ void vec_movh_p64(NO_CPU, const uint64_t *src, union xmm_reg *dst) {
 void vec_movh_pm64(NO_CPU, const union xmm_reg *src, uint64_t *dst) {
     *dst = src->qw[1];
 }
+void vec_movhl_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    dst->qw[0] = src->qw[1];
+}
+void vec_movlh_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    dst->qw[1] = src->qw[0];
+}
 
 void vec_insert_w128(NO_CPU, const uint32_t *src, union xmm_reg *dst, uint8_t index) {
     dst->u16[index % 8] = (uint16_t)*src;
@@ -603,3 +609,178 @@ void vec_muluu128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
         dst->u16[i] = ((res >> 16) & 0xffff);
     }
 }
+
+// SSE3
+
+void vec_hadd_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    union xmm_reg s = *src;
+    dst->f32[0] = dst->f32[0] + dst->f32[1];
+    dst->f32[1] = dst->f32[2] + dst->f32[3];
+    dst->f32[2] = s.f32[0] + s.f32[1];
+    dst->f32[3] = s.f32[2] + s.f32[3];
+}
+void vec_hadd_pd128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    union xmm_reg s = *src;
+    dst->f64[0] = dst->f64[0] + dst->f64[1];
+    dst->f64[1] = s.f64[0] + s.f64[1];
+}
+void vec_hsub_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    union xmm_reg s = *src;
+    dst->f32[0] = dst->f32[0] - dst->f32[1];
+    dst->f32[1] = dst->f32[2] - dst->f32[3];
+    dst->f32[2] = s.f32[0] - s.f32[1];
+    dst->f32[3] = s.f32[2] - s.f32[3];
+}
+void vec_hsub_pd128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    union xmm_reg s = *src;
+    dst->f64[0] = dst->f64[0] - dst->f64[1];
+    dst->f64[1] = s.f64[0] - s.f64[1];
+}
+void vec_addsub_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    dst->f32[0] -= src->f32[0];
+    dst->f32[1] += src->f32[1];
+    dst->f32[2] -= src->f32[2];
+    dst->f32[3] += src->f32[3];
+}
+void vec_addsub_pd128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    dst->f64[0] -= src->f64[0];
+    dst->f64[1] += src->f64[1];
+}
+void vec_dupl_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    union xmm_reg s = *src;
+    dst->u32[0] = dst->u32[1] = s.u32[0];
+    dst->u32[2] = dst->u32[3] = s.u32[2];
+}
+void vec_duph_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) {
+    union xmm_reg s = *src;
+    dst->u32[0] = dst->u32[1] = s.u32[1];
+    dst->u32[2] = dst->u32[3] = s.u32[3];
+}
+void vec_dup_pd64(NO_CPU, const uint64_t *src, union xmm_reg *dst) {
+    dst->qw[0] = dst->qw[1] = *src;
+}
+
+// SSSE3 ops have mm and xmm forms that only differ in width, so both are
+// generated here from the same code instead of being split with mmx.c.
+// n is the width in bytes.
+
+static inline int16_t sat16(int32_t w) {
+    if (w > INT16_MAX)
+        return INT16_MAX;
+    if (w < INT16_MIN)
+        return INT16_MIN;
+    return w;
+}
+
+static inline void ssse3_shuffle_b(union vec *d, const union vec *s, unsigned n) {
+    union vec r;
+    for (unsigned i = 0; i < n; i++)
+        r.u8[i] = s->u8[i] & 0x80 ? 0 : d->u8[s->u8[i] & (n - 1)];
+    *d = r;
+}
+
+#define SSSE3_HORIZONTAL(name, bits, expr) \
+    static inline void ssse3_##name(union vec *d, const union vec *s, unsigned n) { \
+        unsigned half = n / (bits/8) / 2; \
+        union vec r; \
+        for (unsigned i = 0; i < half; i++) { \
+            int##bits##_t a = d->u##bits[2*i], b = d->u##bits[2*i + 1]; \
+            r.u##bits[i] = expr; \
+            a = s->u##bits[2*i], b = s->u##bits[2*i + 1]; \
+            r.u##bits[i + half] = expr; \
+        } \
+        *d = r; \
+    }
+SSSE3_HORIZONTAL(hadd_w, 16, a + b)
+SSSE3_HORIZONTAL(hadd_d, 32, (uint32_t) a + b)
+SSSE3_HORIZONTAL(hadds_w, 16, sat16(a + b))
+SSSE3_HORIZONTAL(hsub_w, 16, a - b)
+SSSE3_HORIZONTAL(hsub_d, 32, (uint32_t) a - b)
+SSSE3_HORIZONTAL(hsubs_w, 16, sat16(a - b))
+
+static inline void ssse3_maddubs_w(union vec *d, const union vec *s, unsigned n) {
+    for (unsigned i = 0; i < n / 2; i++) {
+        int32_t res = d->u8[2*i] * (int8_t) s->u8[2*i] +
+            d->u8[2*i + 1] * (int8_t) s->u8[2*i + 1];
+        d->u16[i] = sat16(res);
+    }
+}
+static inline void ssse3_mulhrs_w(union vec *d, const union vec *s, unsigned n) {
+    for (unsigned i = 0; i < n / 2; i++) {
+        int32_t res = (int16_t) d->u16[i] * (int16_t) s->u16[i];
+        d->u16[i] = ((res >> 14) + 1) >> 1;
+    }
+}
+
+#define SSSE3_ELEMENTWISE(name, bits, expr) \
+    static inline void ssse3_##name(union vec *d, const union vec *s, unsigned n) { \
+        for (unsigned i = 0; i < n / (bits/8); i++) { \
+            int##bits##_t a = d->u##bits[i], b = s->u##bits[i]; \
+            d->u##bits[i] = expr; \
+        } \
+    }
+SSSE3_ELEMENTWISE(sign_b, 8, b < 0 ? -a : b == 0 ? 0 : a)
+SSSE3_ELEMENTWISE(sign_w, 16, b < 0 ? -a : b == 0 ? 0 : a)
+SSSE3_ELEMENTWISE(sign_d, 32, b < 0 ? -(uint32_t) a : b == 0 ? 0 : (uint32_t) a)
+
+// same as above but only looking at the source
+#define SSSE3_UNARY(name, bits, expr) \
+    static inline void ssse3_##name(union vec *d, const union vec *s, unsigned n) { \
+        for (unsigned i = 0; i < n / (bits/8); i++) { \
+            int##bits##_t b = s->u##bits[i]; \
+            d->u##bits[i] = expr; \
+        } \
+    }
+SSSE3_UNARY(abs_b, 8, b < 0 ? -b : b)
+SSSE3_UNARY(abs_w, 16, b < 0 ? -b : b)
+SSSE3_UNARY(abs_d, 32, b < 0 ? -(uint32_t) b : (uint32_t) b)
+
+static inline void ssse3_align_r(union vec *d, const union vec *s, unsigned n, uint8_t amount) {
+    uint8_t both[32];
+    memcpy(both, s->u8, n);
+    memcpy(both + n, d->u8, n);
+    for (unsigned i = 0; i < n; i++)
+        d->u8[i] = i + amount < 2 * n ? both[i + amount] : 0;
+}
+
+#define VEC_SSSE3(name) \
+    void vec_##name##128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst) { \
+        union vec s, d; \
+        memcpy(&s, src, 16); memcpy(&d, dst, 16); \
+        ssse3_##name(&d, &s, 16); \
+        memcpy(dst, &d, 16); \
+    } \
+    void vec_##name##64(NO_CPU, const union mm_reg *src, union mm_reg *dst) { \
+        union vec s, d; \
+        memcpy(&s, src, 8); memcpy(&d, dst, 8); \
+        ssse3_##name(&d, &s, 8); \
+        memcpy(dst, &d, 8); \
+    }
+VEC_SSSE3(shuffle_b)
+VEC_SSSE3(hadd_w)
+VEC_SSSE3(hadd_d)
+VEC_SSSE3(hadds_w)
+VEC_SSSE3(hsub_w)
+VEC_SSSE3(hsub_d)
+VEC_SSSE3(hsubs_w)
+VEC_SSSE3(maddubs_w)
+VEC_SSSE3(mulhrs_w)
+VEC_SSSE3(sign_b)
+VEC_SSSE3(sign_w)
+VEC_SSSE3(sign_d)
+VEC_SSSE3(abs_b)
+VEC_SSSE3(abs_w)
+VEC_SSSE3(abs_d)
+
+void vec_align_r128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst, uint8_t amount) {
+    union vec s, d;
+    memcpy(&s, src, 16); memcpy(&d, dst, 16);
+    ssse3_align_r(&d, &s, 16, amount);
+    memcpy(dst, &d, 16);
+}
+void vec_align_r64(NO_CPU, const union mm_reg *src, union mm_reg *dst, uint8_t amount) {
+    union vec s, d;
+    memcpy(&s, src, 8); memcpy(&d, dst, 8);
+    ssse3_align_r(&d, &s, 8, amount);
+    memcpy(dst, &d, 8);
+}
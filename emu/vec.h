@@ -197,6 +197,9 @@ void vec_movl_p64(NO_CPU, const uint64_t *src, union xmm_reg *dst);
 void vec_movl_pm64(NO_CPU, const union xmm_reg *src, uint64_t *dst);
 void vec_movh_p64(NO_CPU, const uint64_t *src, union xmm_reg *dst);
 void vec_movh_pm64(NO_CPU, const union xmm_reg *src, uint64_t *dst);
+// the register forms of movlps and movhps
+void vec_movhl_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_movlh_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
 
 void vec_movmask_b64(NO_CPU, const union mm_reg *src, uint32_t *dst);
 void vec_movmask_b128(NO_CPU, const union xmm_reg *src, uint32_t *dst);
@@ -209,4 +212,37 @@ void vec_extract_w128(NO_CPU, const union xmm_reg *src, uint32_t *dst, uint8_t i
 void vec_avg_b128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
 void vec_avg_w128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
 
+
+void vec_hadd_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_hadd_pd128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_hsub_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_hsub_pd128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_addsub_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_addsub_pd128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_dupl_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_duph_ps128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst);
+void vec_dup_pd64(NO_CPU, const uint64_t *src, union xmm_reg *dst);
+
+#define VEC_SSSE3_DECL(name) \
+    void vec_##name##128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst); \
+    void vec_##name##64(NO_CPU, const union mm_reg *src, union mm_reg *dst);
+VEC_SSSE3_DECL(shuffle_b)
+VEC_SSSE3_DECL(hadd_w)
+VEC_SSSE3_DECL(hadd_d)
+VEC_SSSE3_DECL(hadds_w)
+VEC_SSSE3_DECL(hsub_w)
+VEC_SSSE3_DECL(hsub_d)
+VEC_SSSE3_DECL(hsubs_w)
+VEC_SSSE3_DECL(maddubs_w)
+VEC_SSSE3_DECL(mulhrs_w)
+VEC_SSSE3_DECL(sign_b)
+VEC_SSSE3_DECL(sign_w)
+VEC_SSSE3_DECL(sign_d)
+VEC_SSSE3_DECL(abs_b)
+VEC_SSSE3_DECL(abs_w)
+VEC_SSSE3_DECL(abs_d)
+#undef VEC_SSSE3_DECL
+void vec_align_r128(NO_CPU, const union xmm_reg *src, union xmm_reg *dst, uint8_t amount);
+void vec_align_r64(NO_CPU, const union mm_reg *src, union mm_reg *dst, uint8_t amount);
+
 #endif
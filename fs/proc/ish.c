@@ -2,11 +2,15 @@
 #include "fs/proc/ish.h"
 #include "fs/proc/net.h"
 #include "kernel/errno.h"
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include "kernel/task.h"
+#include "emu/interrupt.h"
+#include "jit/jit.h"
 
 #import <ifaddrs.h>
 #import <netinet/in.h>
@@ -324,6 +328,69 @@ static int proc_ish_show_ips(struct proc_entry *UNUSED(entry), struct proc_data
     return 0;
 }
 
+#if ENGINE_JIT
+static const char *jit_exit_names[256] = {
+    [(uint8_t) INT_NONE] = "none",
+    [INT_DIV] = "div",
+    [INT_DEBUG] = "debug",
+    [INT_BREAKPOINT] = "breakpoint",
+    [INT_UNDEFINED] = "undefined",
+    [INT_GPF] = "gpf",
+    [INT_TIMER] = "timer",
+    [INT_SYSCALL] = "syscall",
+};
+
+// One column for this process's jit and one for everything, with - where a
+// number only makes sense for one of them.
+static int proc_ish_show_jit(struct proc_entry *UNUSED(entry), struct proc_data *buf) {
+    struct jit *jit = current->mem->mmu.jit;
+    struct jit_stats mine, all;
+    jit_stats_collect(jit, &mine);
+    jit_stats_collect(NULL, &all);
+
+    lock(&jit->lock, 0);
+    size_t blocks = jit->num_blocks;
+    size_t mem_used = jit->mem_used;
+    uint64_t evictions = jit->evictions;
+    unlock(&jit->lock);
+
+    proc_printf(buf, "%-20s %16s %16s\n", "", "process", "all");
+    proc_printf(buf, "%-20s %16zu %16s\n", "blocks", blocks, "-");
+    proc_printf(buf, "%-20s %16zu %16zu\n", "mem_used", mem_used, jit_global_mem_used);
+    proc_printf(buf, "%-20s %16zu %16s\n", "hash_size", jit_hash_size(jit), "-");
+    proc_printf(buf, "%-20s %16" PRIu64 " %16" PRIu64 "\n", "evictions", evictions, jit_global_evictions);
+#define STAT(name) \
+    proc_printf(buf, "%-20s %16" PRIu64 " %16" PRIu64 "\n", #name, mine.name, all.name)
+    STAT(cache_hits);
+    STAT(cache_misses);
+    STAT(lookup_misses);
+    STAT(interpreted);
+    STAT(compiled);
+    STAT(shared_copies);
+    STAT(traces);
+    STAT(compile_ns);
+    STAT(queued);
+    STAT(speculated);
+    STAT(chained);
+    STAT(ic_fills);
+    STAT(invalidated_write);
+    STAT(invalidated_unmap);
+    STAT(jetsam_freed);
+#undef STAT
+    for (int i = 0; i < 256; i++) {
+        if (all.exits[i] == 0)
+            continue;
+        char name[20];
+        if (jit_exit_names[i] != NULL)
+            snprintf(name, sizeof(name), "exit_%s", jit_exit_names[i]);
+        else
+            snprintf(name, sizeof(name), "exit_%d", i);
+        proc_printf(buf, "%-20s %16" PRIu64 " %16" PRIu64 "\n", name, mine.exits[i], all.exits[i]);
+    }
+    return 0;
+}
+#endif
+
 static int proc_ish_show_version(struct proc_entry *UNUSED(entry), struct proc_data *buf) {
     proc_printf(buf, "%s\n", proc_ish_version);
     return 0;
@@ -335,5 +402,8 @@ struct proc_children proc_ish_children = PROC_CHILDREN({
     {"defaults", S_IFDIR, .readdir = proc_ish_defaults_readdir},
     {"documents", .show = proc_ish_show_documents},
     {"ips", .show = proc_ish_show_ips},
+#if ENGINE_JIT
+    {"jit", .show = proc_ish_show_jit},
+#endif
     {"version", .show = proc_ish_show_version},
 });
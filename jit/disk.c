@@ -0,0 +1,379 @@
+#define DEFAULT_CHANNEL instr
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if __APPLE__
+#include <dlfcn.h>
+#include <mach-o/loader.h>
+#else
+#include <link.h>
+#endif
+#include "debug.h"
+#include "jit/jit.h"
+#include "jit/gen.h"
+#include "emu/cpu.h"
+#include "emu/memory.h"
+#include "kernel/fs.h"
+
+extern int current_pid(void);
+
+// Templates for code mapped from files are appended to one cache file per
+// guest file, named after the file's identity, so they survive restarting the
+// emulator. Host pointers in the code are stored as offsets from gadget_exit,
+// and a fingerprint of the build in the header makes files written by a
+// different build get thrown out. Everything in a cache file is only a
+// candidate: the guest bytes are still compared on every hit.
+
+#ifndef JIT_CACHE_DIR
+#define JIT_CACHE_DIR ""
+#endif
+#ifndef JIT_DISK_CACHE_SIZE
+#define JIT_DISK_CACHE_SIZE 64
+#endif
+
+const char *jit_cache_dir = JIT_CACHE_DIR;
+
+#define JIT_DISK_MAGIC 0x4b44534a // JSDK
+#define JIT_DISK_VERSION 5
+
+struct jit_disk_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t fingerprint;
+};
+
+struct jit_disk_record {
+    uint32_t addr;
+    uint32_t guest_size;
+    uint32_t size;
+    uint32_t jump_ip[2];
+    uint32_t block_patch_ip;
+    // followed by the host_ptrs and gadgets bitmaps, code and guest bytes,
+    // padded to 8
+};
+
+struct jit_disk_file {
+    qword_t dev;
+    qword_t inode;
+    qword_t size;
+    dword_t mtime;
+    dword_t mtime_nsec;
+    bool loaded;
+    int fd; // for appending, -1 if not open yet
+    struct list files;
+};
+
+static struct {
+    struct list files;
+    size_t size; // of everything in the directory
+    bool size_known;
+    uint64_t fingerprint;
+    lock_t lock;
+} jit_disk = {.files = LIST_INITIALIZER(jit_disk.files)};
+
+extern void gadget_exit(void);
+static inline unsigned long jit_disk_anchor(void) {
+    return (unsigned long) gadget_exit;
+}
+
+static uint64_t jit_disk_hash(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3; // FNV-1a
+    }
+    return hash;
+}
+
+// The fingerprint is the linker's build id of whatever image the gadgets are
+// in, which changes whenever anything cached code could point at does.
+#if __APPLE__
+static bool jit_disk_build_id(uint64_t *hash) {
+    Dl_info info;
+    if (!dladdr((void *) gadget_exit, &info) || info.dli_fbase == NULL)
+        return false;
+    const struct mach_header_64 *header = info.dli_fbase;
+    const struct load_command *cmd = (const void *) (header + 1);
+    for (uint32_t i = 0; i < header->ncmds; i++) {
+        if (cmd->cmd == LC_UUID) {
+            const struct uuid_command *uuid = (const void *) cmd;
+            *hash = jit_disk_hash(*hash, uuid->uuid, sizeof(uuid->uuid));
+            return true;
+        }
+        cmd = (const void *) ((const char *) cmd + cmd->cmdsize);
+    }
+    return false;
+}
+#else
+static int jit_disk_find_build_id(struct dl_phdr_info *info, size_t UNUSED(size), void *data) {
+    uint64_t *hash = data;
+    unsigned long anchor = jit_disk_anchor();
+    bool ours = false;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        unsigned long start = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && anchor >= start && anchor < start + phdr->p_memsz)
+            ours = true;
+    }
+    if (!ours)
+        return 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE)
+            continue;
+        const char *note = (const char *) (info->dlpi_addr + phdr->p_vaddr);
+        const char *end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nhdr = (const void *) note;
+            const char *name = note + sizeof(*nhdr);
+            const char *desc = name + ((nhdr->n_namesz + 3) & ~3);
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                    memcmp(name, "GNU", 4) == 0 && desc + nhdr->n_descsz <= end) {
+                *hash = jit_disk_hash(*hash, desc, nhdr->n_descsz);
+                return 1;
+            }
+            note = desc + ((nhdr->n_descsz + 3) & ~3);
+        }
+    }
+    return -1;
+}
+static bool jit_disk_build_id(uint64_t *hash) {
+    return dl_iterate_phdr(jit_disk_find_build_id, hash) == 1;
+}
+#endif
+
+// 0 if there's nothing to tell builds apart by, which turns the cache off
+static uint64_t jit_disk_fingerprint(void) {
+    uint64_t hash = 0xcbf29ce484222325;
+    if (!jit_disk_build_id(&hash))
+        return 0;
+    size_t cpu_size = sizeof(struct cpu_state);
+    return jit_disk_hash(hash, &cpu_size, sizeof(cpu_size));
+}
+
+__attribute__((constructor)) static void jit_disk_init() {
+    lock_init(&jit_disk.lock, "jit_disk\0");
+    jit_disk.fingerprint = jit_disk_fingerprint();
+}
+
+static inline bool jit_disk_enabled(void) {
+    return jit_cache_dir != NULL && jit_cache_dir[0] != '\0' && jit_disk.fingerprint != 0;
+}
+
+static size_t jit_disk_record_size(unsigned guest_size, unsigned size) {
+    size_t record_size = sizeof(struct jit_disk_record) +
+        (BITMAP_WORDS(size) * 2 + size) * sizeof(unsigned long) + guest_size;
+    return (record_size + 7) & ~7;
+}
+
+static void jit_disk_path(struct jit_disk_file *file, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%llx-%llx-%llx-%x.%x.jit", jit_cache_dir,
+            (unsigned long long) file->dev, (unsigned long long) file->inode,
+            (unsigned long long) file->size, file->mtime, file->mtime_nsec);
+}
+
+static void jit_disk_measure(void) {
+    DIR *dir = opendir(jit_cache_dir);
+    if (dir == NULL) {
+        mkdir(jit_cache_dir, 0755);
+        jit_disk.size_known = true;
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat stat;
+        if (fstatat(dirfd(dir), ent->d_name, &stat, 0) == 0 && S_ISREG(stat.st_mode))
+            jit_disk.size += stat.st_size;
+    }
+    closedir(dir);
+    jit_disk.size_known = true;
+}
+
+// Must be called with jit_disk.lock held
+static struct jit_disk_file *jit_disk_file_get(struct data *data) {
+    if (data->jit_disk_file != NULL)
+        return data->jit_disk_file;
+    if (data->fd == NULL || data->fd->mount == NULL)
+        return NULL;
+    struct statbuf stat;
+    if (data->fd->mount->fs->fstat(data->fd, &stat) < 0)
+        return NULL;
+
+    struct jit_disk_file *file;
+    list_for_each_entry(&jit_disk.files, file, files) {
+        if (file->dev == stat.dev && file->inode == stat.inode && file->size == stat.size &&
+                file->mtime == stat.mtime && file->mtime_nsec == stat.mtime_nsec)
+            goto found;
+    }
+    file = calloc(1, sizeof(*file));
+    if (file == NULL)
+        return NULL;
+    file->dev = stat.dev;
+    file->inode = stat.inode;
+    file->size = stat.size;
+    file->mtime = stat.mtime;
+    file->mtime_nsec = stat.mtime_nsec;
+    file->fd = -1;
+    list_add(&jit_disk.files, &file->files);
+found:
+    data->jit_disk_file = file;
+    return file;
+}
+
+static void jit_disk_read(struct jit_disk_file *file) {
+    char path[PATH_MAX];
+    jit_disk_path(file, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat stat;
+    if (fstat(fd, &stat) < 0 || stat.st_size < (off_t) sizeof(struct jit_disk_header)) {
+        close(fd);
+        return;
+    }
+    size_t size = stat.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    const struct jit_disk_header *header = (const void *) map;
+    if (header->magic != JIT_DISK_MAGIC || header->version != JIT_DISK_VERSION ||
+            header->fingerprint != jit_disk.fingerprint) {
+        // written by some other build, start over
+        munmap((void *) map, size);
+        unlink(path);
+        return;
+    }
+
+    unsigned long anchor = jit_disk_anchor();
+    int loaded = 0;
+    size_t offset = sizeof(struct jit_disk_header);
+    while (offset + sizeof(struct jit_disk_record) <= size) {
+        const struct jit_disk_record *record = (const void *) (map + offset);
+        if (record->size == 0 || record->size > PAGE_SIZE * 16 || record->guest_size > PAGE_SIZE ||
+                record->jump_ip[0] >= record->size || record->jump_ip[1] >= record->size ||
+                record->block_patch_ip >= record->size)
+            break;
+        size_t record_size = jit_disk_record_size(record->guest_size, record->size);
+        if (offset + record_size > size)
+            break; // torn write at the end
+        offset += record_size;
+
+        struct jit_template *template = jit_template_new(record->addr, record->guest_size, record->size);
+        if (template == NULL)
+            break;
+        for (int i = 0; i <= 1; i++)
+            template->jump_ip[i] = record->jump_ip[i];
+        template->block_patch_ip = record->block_patch_ip;
+        const char *p = (const char *) (record + 1);
+        memcpy(template->host_ptrs, p, BITMAP_WORDS(record->size) * sizeof(unsigned long));
+        p += BITMAP_WORDS(record->size) * sizeof(unsigned long);
+        memcpy(template->gadgets, p, BITMAP_WORDS(record->size) * sizeof(unsigned long));
+        p += BITMAP_WORDS(record->size) * sizeof(unsigned long);
+        memcpy(template->code, p, record->size * sizeof(unsigned long));
+        p += record->size * sizeof(unsigned long);
+        memcpy(template->guest, p, record->guest_size);
+        for (unsigned i = 0; i < template->size; i++) {
+            if (BITMAP_TEST(template->host_ptrs, i))
+                template->code[i] += anchor;
+        }
+        jit_shared_insert(template);
+        loaded++;
+    }
+    munmap((void *) map, size);
+    TRACE_(verbose, "%d loaded %d blocks from %s\n", current_pid(), loaded, path);
+}
+
+bool jit_disk_load(struct data *data) {
+    if (!jit_disk_enabled())
+        return false;
+    lock(&jit_disk.lock, 0);
+    struct jit_disk_file *file = jit_disk_file_get(data);
+    bool load = file != NULL && !file->loaded;
+    if (load) {
+        file->loaded = true;
+        jit_disk_read(file);
+    }
+    unlock(&jit_disk.lock);
+    return load;
+}
+
+static int jit_disk_open(struct jit_disk_file *file) {
+    char path[PATH_MAX];
+    jit_disk_path(file, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    struct stat stat;
+    if (fstat(fd, &stat) == 0 && stat.st_size == 0) {
+        struct jit_disk_header header = {
+            .magic = JIT_DISK_MAGIC,
+            .version = JIT_DISK_VERSION,
+            .fingerprint = jit_disk.fingerprint,
+        };
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            return -1;
+        }
+        jit_disk.size += sizeof(header);
+    }
+    return fd;
+}
+
+void jit_disk_save(struct data *data, struct jit_template *template) {
+    if (!jit_disk_enabled())
+        return;
+    lock(&jit_disk.lock, 0);
+    if (!jit_disk.size_known)
+        jit_disk_measure();
+    size_t record_size = jit_disk_record_size(template->guest_size, template->size);
+    if (jit_disk.size + record_size > (size_t) JIT_DISK_CACHE_SIZE << 20)
+        goto out;
+    struct jit_disk_file *file = jit_disk_file_get(data);
+    if (file == NULL)
+        goto out;
+    if (file->fd < 0 && (file->fd = jit_disk_open(file)) < 0)
+        goto out;
+
+    char *buf = calloc(1, record_size);
+    if (buf == NULL)
+        goto out;
+    struct jit_disk_record *record = (void *) buf;
+    record->addr = template->addr;
+    record->guest_size = template->guest_size;
+    record->size = template->size;
+    for (int i = 0; i <= 1; i++)
+        record->jump_ip[i] = template->jump_ip[i];
+    record->block_patch_ip = template->block_patch_ip;
+    char *p = (char *) (record + 1);
+    memcpy(p, template->host_ptrs, BITMAP_WORDS(template->size) * sizeof(unsigned long));
+    p += BITMAP_WORDS(template->size) * sizeof(unsigned long);
+    memcpy(p, template->gadgets, BITMAP_WORDS(template->size) * sizeof(unsigned long));
+    p += BITMAP_WORDS(template->size) * sizeof(unsigned long);
+    unsigned long *code = (unsigned long *) p;
+    unsigned long anchor = jit_disk_anchor();
+    for (unsigned i = 0; i < template->size; i++) {
+        code[i] = template->code[i];
+        if (BITMAP_TEST(template->host_ptrs, i))
+            code[i] -= anchor;
+    }
+    // patched to the block's own address when it's instantiated
+    if (template->block_patch_ip != 0)
+        code[template->block_patch_ip] = 0;
+    p += template->size * sizeof(unsigned long);
+    memcpy(p, template->guest, template->guest_size);
+
+    // one write, so concurrent emulators appending to the same file don't
+    // interleave records
+    if (write(file->fd, buf, record_size) == (ssize_t) record_size)
+        jit_disk.size += record_size;
+    free(buf);
+out:
+    unlock(&jit_disk.lock);
+}
@@ -1,9 +1,7 @@
 #include <stdatomic.h>
 #include "emu/cpu.h"
 
-// keep in sync with asm
-#define JIT_RETURN_CACHE_SIZE 4096
-#define JIT_RETURN_CACHE_HASH(x) ((x) & 0xFFF0) >> 4)
+#define JIT_RETURN_STACK_SIZE 64
 
 struct jit_frame {
     struct cpu_state cpu;
@@ -11,5 +9,12 @@ struct jit_frame {
     addr_t value_addr;
     uint64_t value[2]; // buffer for crosspage crap
     struct jit_block *last_block;
-    long ret_cache[JIT_RETURN_CACHE_SIZE]; // a map of ip to pointer-to-call-gadget-arguments
+    // inline cache slot of last_block that missed, see jmp_indir
+    unsigned long *ic_miss;
+    // Shadow of the guest call stack: pointers to the arguments of the call
+    // gadgets that ran, most recent at ret_top. Calls nested deeper than this
+    // wrap around, and ret checks the return address before trusting an
+    // entry, so being wrong only costs a trip through the dispatcher.
+    long ret_stack[JIT_RETURN_STACK_SIZE];
+    unsigned ret_top;
 };
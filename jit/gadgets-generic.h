@@ -81,6 +81,29 @@
     .gadget_list_size \type, GADGET_LIST
 .endm
 
+# memory operands with the address computed in the gadget: [reg+disp] for
+# each size, and [reg+reg*scale+disp] for 32 bits only
+.macro .gadget_array_base type
+    _gadget_array_start \type\()_base
+        # sync with enum size
+        gadgets \type\()8_base, REG_LIST
+        gadgets \type\()16_base, REG_LIST
+        gadgets \type\()32_base, REG_LIST
+    .popsection
+.endm
+.macro _gadget_array_sib_base type, base
+    .irp index, REG_LIST
+        gadgets \type\()32_sib_\base\()_\index, 1,2,4,8
+    .endr
+.endm
+.macro .gadget_array_sib type
+    _gadget_array_start \type\()_sib
+        .irp base, REG_LIST
+            _gadget_array_sib_base \type, \base
+        .endr
+    .popsection
+.endm
+
 # jfc
 # https://github.com/llvm-mirror/llvm/blob/release_80/lib/Target/AArch64/MCTargetDesc/AArch64MCAsmInfo.cpp#L41
 # https://bugs.llvm.org/show_bug.cgi?id=39010#c4
@@ -17,12 +17,88 @@
 
 .extern jit_exit
 
+# Right before every gadget is what the native tier (see native.c) needs to
+# copy it: how many bytes there are up to the jmp of its first gret, how long
+# that jmp is, and where the rel32 branches to the out of line code of the
+# memory macros end, so the copy can be pointed back at them. A gadget that
+# branches or calls anywhere else before its first gret says native_stop
+# first, which makes it uncopyable, and so does getting to the next gadget
+# without a gret, or being the last one in a file without one. Gadgets are
+# only ever jumped to, so none of this gets executed.
+.set native_open, 0
+.macro native_here what
+.endm
+.macro native_stop
+    native_here stop
+.endm
+
 .macro .gadget name
+    native_stop
+    .short .Lnative_reloc0_\name - NAME(gadget_\()\name)
+    .short .Lnative_reloc1_\name - NAME(gadget_\()\name)
+    .short .Lnative_reloc2_\name - NAME(gadget_\()\name)
+    .short .Lnative_reloc3_\name - NAME(gadget_\()\name)
+    .short .Lnative_tail_\name - .Lnative_end_\name
+    .short 0
+    .long .Lnative_end_\name - NAME(gadget_\()\name)
     .global.name gadget_\()\name
+    .set native_open, 1
+    .set native_relocs, 0
+    .purgem native_here
+    .macro native_here what
+        .if native_open
+            .ifc \what,reloc
+                .if native_relocs == 0
+                    .Lnative_reloc0_\name :
+                .elseif native_relocs == 1
+                    .Lnative_reloc1_\name :
+                .elseif native_relocs == 2
+                    .Lnative_reloc2_\name :
+                .elseif native_relocs == 3
+                    .Lnative_reloc3_\name :
+                .else
+                    # no room to say where this one is
+                    .set .Lnative_end_\name, NAME(gadget_\()\name)
+                    .set .Lnative_tail_\name, NAME(gadget_\()\name)
+                    .set native_open, 0
+                .endif
+                .set native_relocs, native_relocs + 1
+            .endif
+            .ifc \what,end
+                .Lnative_end_\name :
+            .endif
+            .ifc \what,stop
+                .set .Lnative_end_\name, NAME(gadget_\()\name)
+                .set .Lnative_tail_\name, NAME(gadget_\()\name)
+            .endif
+            .ifc \what,tail
+                .Lnative_tail_\name :
+            .endif
+            .ifnc \what,reloc
+            .ifnc \what,end
+                .if native_relocs < 1
+                    .set .Lnative_reloc0_\name, NAME(gadget_\()\name)
+                .endif
+                .if native_relocs < 2
+                    .set .Lnative_reloc1_\name, NAME(gadget_\()\name)
+                .endif
+                .if native_relocs < 3
+                    .set .Lnative_reloc2_\name, NAME(gadget_\()\name)
+                .endif
+                .if native_relocs < 4
+                    .set .Lnative_reloc3_\name, NAME(gadget_\()\name)
+                .endif
+                .set native_open, 0
+            .endif
+            .endif
+        .endif
+    .endm
 .endm
 .macro gret pop=0
     addq $((\pop+1)*8), %_ip
+    native_here end
     jmp *-8(%_ip)
+    native_here tail
 .endm
 
 # memory reading and writing
@@ -40,6 +116,7 @@
     andl $0xfff, %r15d
     cmpl $(0x1000-(\size/8)), %r15d
     ja crosspage_load_\id
+    native_here reloc
     movl %_addr, %r15d
     andl $0xfffff000, %r15d
     .ifc \type,read
@@ -49,6 +126,7 @@
     .endif
     movl %r15d, -TLB_entries+TLB_dirty_page(%_tlb)
     jne handle_miss_\id
+    native_here reloc
     addq TLB_ENTRY_data_minus_addr(%_tlb,%r14), %_addrq
 back_\id :
 
@@ -68,6 +146,7 @@ crosspage_load_\id :
     leaq LOCAL_value(%_cpu), %r14
     cmpq %_addrq, %r14
     je crosspage_store_\id
+    native_here reloc
 back_write_done_\id :
 .pushsection_bullshit
 crosspage_store_\id :
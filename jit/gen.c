@@ -16,6 +16,16 @@ int gen_step(struct gen_state *state, struct tlb *tlb) {
     return gen_step32(state, tlb);
 }
 
+static void gen_grow_bitmap(unsigned long **bitmap, unsigned capacity) {
+    unsigned long *bigger_bitmap = realloc(*bitmap, BITMAP_WORDS(capacity) * sizeof(unsigned long));
+    if (bigger_bitmap == NULL) {
+        die("out of memory while jitting");
+    }
+    memset(bigger_bitmap + BITMAP_WORDS(capacity / 2), 0,
+            (BITMAP_WORDS(capacity) - BITMAP_WORDS(capacity / 2)) * sizeof(unsigned long));
+    *bitmap = bigger_bitmap;
+}
+
 static void gen(struct gen_state *state, unsigned long thing) {
     assert(state->size <= state->capacity);
     if (state->size >= state->capacity) {
@@ -26,19 +36,43 @@ static void gen(struct gen_state *state, unsigned long thing) {
             die("out of memory while jitting");
         }
         state->block = bigger_block;
+        gen_grow_bitmap(&state->host_ptrs, state->capacity);
+        gen_grow_bitmap(&state->gadgets, state->capacity);
     }
     assert(state->size < state->capacity);
     state->block->code[state->size++] = thing;
 }
 
-void gen_start(addr_t addr, struct gen_state *state) {
+static void gen_host(struct gen_state *state, unsigned long thing) {
+    gen(state, thing);
+    state->host_ptrs[(state->size - 1) / 64] |= 1ul << ((state->size - 1) % 64);
+}
+
+static void gen_gadget(struct gen_state *state, unsigned long thing) {
+    gen_host(state, thing);
+    state->gadgets[(state->size - 1) / 64] |= 1ul << ((state->size - 1) % 64);
+}
+
+void gen_start(struct jit *jit, addr_t addr, struct gen_state *state) {
+    state->jit = jit;
     state->capacity = JIT_BLOCK_INITIAL_CAPACITY;
     state->size = 0;
     state->ip = addr;
+    state->start = addr;
     for (int i = 0; i <= 1; i++) {
         state->jump_ip[i] = 0;
     }
     state->block_patch_ip = 0;
+    state->last_op_type = NULL;
+    state->fuse_end = 0;
+    state->segfaulted = false;
+    state->precise_flags = false;
+    state->trace = NULL;
+    state->trace_len = 0;
+    state->trace_pos = 0;
+    state->side_exits_count = 0;
+    state->host_ptrs = calloc(BITMAP_WORDS(state->capacity), sizeof(unsigned long));
+    state->gadgets = calloc(BITMAP_WORDS(state->capacity), sizeof(unsigned long));
 
     struct jit_block *block = malloc(sizeof(struct jit_block) + state->capacity * sizeof(unsigned long));
     state->block = block;
@@ -46,7 +80,25 @@ void gen_start(addr_t addr, struct gen_state *state) {
 }
 
 void gen_end(struct gen_state *state) {
-    struct jit_block *block = state->block;
+    // the gadget map goes right after the code, then the side exits, and now
+    // that the size is known the whole thing can go into the arena without
+    // wasting space
+    unsigned words = state->size + BITMAP_WORDS(state->size) +
+        state->side_exits_count * sizeof(struct jit_side_exit) / sizeof(unsigned long);
+    struct jit_block *block = jit_arena_alloc(state->jit,
+            sizeof(struct jit_block) + words * sizeof(unsigned long));
+    block->addr = state->block->addr;
+    memcpy(block->code, state->block->code, state->size * sizeof(unsigned long));
+    free(state->block);
+    state->block = block;
+    state->capacity = words;
+    block->gadgets = &block->code[state->size];
+    memcpy(block->gadgets, state->gadgets, BITMAP_WORDS(state->size) * sizeof(unsigned long));
+    block->exec_count = 0;
+    // new blocks get one pass of the clock hand before they can be evicted
+    block->referenced = true;
+    block->native = false;
+    block->is_trace = false;
     for (int i = 0; i <= 1; i++) {
         if (state->jump_ip[i] != 0) {
             block->jump_ip[i] = &block->code[state->jump_ip[i]];
@@ -58,6 +110,15 @@ void gen_end(struct gen_state *state) {
         list_init(&block->jumps_from[i]);
         list_init(&block->jumps_from_links[i]);
     }
+    block->side_exits = (struct jit_side_exit *) &block->gadgets[BITMAP_WORDS(state->size)];
+    block->side_exits_count = state->side_exits_count;
+    for (unsigned i = 0; i < state->side_exits_count; i++) {
+        struct jit_side_exit *side = &block->side_exits[i];
+        side->ip = &block->code[state->side_exit_ip[i]];
+        side->old_ip = *side->ip;
+        list_init(&side->link);
+    }
+    list_init(&block->side_jumps_from);
     if (state->block_patch_ip != 0) {
         block->code[state->block_patch_ip] = (unsigned long) block;
     }
@@ -65,17 +126,23 @@ void gen_end(struct gen_state *state) {
         block->end_addr = state->ip - 1;
     else
         block->end_addr = block->addr;
-    list_init(&block->chain);
     block->is_jetsam = false;
     for (int i = 0; i <= 1; i++) {
         list_init(&block->page[i]);
     }
 }
 
+void gen_free(struct gen_state *state) {
+    free(state->host_ptrs);
+    state->host_ptrs = NULL;
+    free(state->gadgets);
+    state->gadgets = NULL;
+}
+
 void gen_exit(struct gen_state *state) {
     extern void gadget_exit(void);
     // in case the last instruction didn't end the block
-    gen(state, (unsigned long) gadget_exit);
+    gen_gadget(state, (unsigned long) gadget_exit);
     gen(state, state->ip);
 }
 
@@ -130,23 +197,25 @@ enum repeat {
 typedef void (*gadget_t)(void);
 
 #define GEN(thing) gen(state, (unsigned long) (thing))
-#define g(g) do { extern void gadget_##g(void); GEN(gadget_##g); } while (0)
+#define GEN_HOST(thing) gen_host(state, (unsigned long) (thing))
+#define GEN_GADGET(thing) gen_gadget(state, (unsigned long) (thing))
+#define g(g) do { extern void gadget_##g(void); GEN_GADGET(gadget_##g); } while (0)
 #define gg(_g, a) do { g(_g); GEN(a); } while (0)
 #define ggg(_g, a, b) do { g(_g); GEN(a); GEN(b); } while (0)
 #define gggg(_g, a, b, c) do { g(_g); GEN(a); GEN(b); GEN(c); } while (0)
 #define ggggg(_g, a, b, c, d) do { g(_g); GEN(a); GEN(b); GEN(c); GEN(d); } while (0)
 #define gggggg(_g, a, b, c, d, e) do { g(_g); GEN(a); GEN(b); GEN(c); GEN(d); GEN(e); } while (0)
-#define ga(g, i) do { extern gadget_t g##_gadgets[]; if (g##_gadgets[i] == NULL) UNDEFINED; GEN(g##_gadgets[i]); } while (0)
+#define ga(g, i) do { extern gadget_t g##_gadgets[]; if (g##_gadgets[i] == NULL) UNDEFINED; GEN_GADGET(g##_gadgets[i]); } while (0)
 #define gag(g, i, a) do { ga(g, i); GEN(a); } while (0)
 #define gagg(g, i, a, b) do { ga(g, i); GEN(a); GEN(b); } while (0)
 #define gz(g, z) ga(g, sz(z))
-#define h(h) gg(helper_0, h)
-#define hh(h, a) ggg(helper_1, h, a)
-#define hhh(h, a, b) gggg(helper_2, h, a, b)
-#define h_read(h, z) do { g_addr(); ggg(helper_read##z, state->orig_ip, h##z); } while (0)
-#define h_write(h, z) do { g_addr(); ggg(helper_write##z, state->orig_ip, h##z); } while (0)
+#define h(h) do { g(helper_0); GEN_HOST(h); } while (0)
+#define hh(h, a) do { g(helper_1); GEN_HOST(h); GEN(a); } while (0)
+#define hhh(h, a, b) do { g(helper_2); GEN_HOST(h); GEN(a); GEN(b); } while (0)
+#define h_read(h, z) do { g_addr(); gg(helper_read##z, state->orig_ip); GEN_HOST(h##z); } while (0)
+#define h_write(h, z) do { g_addr(); gg(helper_write##z, state->orig_ip); GEN_HOST(h##z); } while (0)
 #define UNDEFINED do { gggg(interrupt, INT_UNDEFINED, state->orig_ip, state->orig_ip); return false; } while (0)
-#define SEGFAULT do { gggg(interrupt, INT_GPF, state->orig_ip, tlb->segfault_addr); return false; } while (0)
+#define SEGFAULT do { state->segfaulted = true; gggg(interrupt, INT_GPF, state->orig_ip, tlb->segfault_addr); return false; } while (0)
 
 static inline int sz(int size) {
     switch (size) {
@@ -170,11 +239,49 @@ bool gen_addr(struct gen_state *state, struct modrm *modrm, bool seg_gs) {
 }
 #define g_addr() gen_addr(state, &modrm, seg_gs)
 
+// [reg+disp] and [reg+reg*scale+disp] have gadgets for the most common ops
+// that compute the address and do the access in one go
+static gadget_t gen_mem_gadget(gadget_t *gadgets, int size, struct modrm *modrm) {
+    extern gadget_t load_gadgets[], store_gadgets[], add_gadgets[], sub_gadgets[],
+           and_gadgets[], or_gadgets[], xor_gadgets[];
+    extern gadget_t load_base_gadgets[], store_base_gadgets[], add_base_gadgets[],
+           sub_base_gadgets[], and_base_gadgets[], or_base_gadgets[], xor_base_gadgets[];
+    extern gadget_t load_sib_gadgets[], store_sib_gadgets[];
+    static const struct {
+        gadget_t *gadgets;
+        gadget_t *base;
+        gadget_t *sib;
+    } mem_gadgets[] = {
+        {load_gadgets, load_base_gadgets, load_sib_gadgets},
+        {store_gadgets, store_base_gadgets, store_sib_gadgets},
+        {add_gadgets, add_base_gadgets, NULL},
+        {sub_gadgets, sub_base_gadgets, NULL},
+        {and_gadgets, and_base_gadgets, NULL},
+        {or_gadgets, or_base_gadgets, NULL},
+        {xor_gadgets, xor_base_gadgets, NULL},
+    };
+    if (modrm->base == reg_none)
+        return NULL;
+    for (unsigned i = 0; i < array_size(mem_gadgets); i++) {
+        if (mem_gadgets[i].gadgets != gadgets)
+            continue;
+        if (modrm->type == modrm_mem)
+            return mem_gadgets[i].base[size * reg_count + modrm->base];
+        if (mem_gadgets[i].sib != NULL && size == size_32)
+            return mem_gadgets[i].sib[(modrm->base * reg_count + modrm->index) * 4 + modrm->shift];
+        break;
+    }
+    return NULL;
+}
+
 // this really wants to use all the locals of the decoder, which we can do
 // really nicely in gcc using nested functions, but that won't work in clang,
 // so we explicitly pass 500 arguments. sorry for the mess
 static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg arg, struct modrm *modrm, uint64_t *imm, int size, bool seg_gs, dword_t addr_offset) {
     size = sz(size);
+    gadget_t *type = gadgets;
+    state->last_op_type = type;
+    state->last_op_size = size;
     gadgets = gadgets + size * arg_count;
 
     switch (arg) {
@@ -201,11 +308,24 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
     if (arg >= arg_count || gadgets[arg] == NULL) {
         UNDEFINED;
     }
+    if (arg == arg_mem && !seg_gs) {
+        gadget_t gadget = gen_mem_gadget(type, size, modrm);
+        if (gadget != NULL) {
+            // the fused jumps expect the address to be done already
+            state->last_op_type = NULL;
+            GEN_GADGET(gadget);
+            GEN(state->orig_ip | state->orig_ip_extra);
+            GEN(modrm->offset);
+            return true;
+        }
+    }
     if (arg == arg_mem || arg == arg_addr) {
         if (!gen_addr(state, modrm, seg_gs))
             return false;
     }
-    GEN(gadgets[arg]);
+    state->last_op_arg = arg;
+    state->last_op_ip = state->size;
+    GEN_GADGET(gadgets[arg]);
     if (arg == arg_imm)
         GEN(*imm);
     else if (arg == arg_mem)
@@ -217,11 +337,108 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
     if (!gen_op(state, type##_gadgets, arg_##thing, &modrm, &imm, z, seg_gs, addr_offset)) return false; \
 } while (0)
 
+// Whether the flags set by the instruction being generated get overwritten
+// before anything reads them, in which case the gadgets can skip computing
+// them. This looks ahead for an instruction that sets all of the arithmetic
+// flags, past a few that don't touch them. Everything on the way has to be
+// register only and in the same block, so nothing can fault or get
+// interrupted while the flags are wrong.
+static bool gen_flags_dead(struct gen_state *state, struct tlb *tlb) {
+    if (state->precise_flags)
+        return false;
+    addr_t ip = state->ip;
+    for (int i = 0; i < 4; i++) {
+        // the block gets cut off here, see jit_block_compile
+        if (ip - state->start >= PAGE_SIZE - 15)
+            return false;
+        byte_t code[8];
+        if (!tlb_read(tlb, ip, code, sizeof(code)))
+            return false;
+        byte_t modrm = code[1];
+        bool modrm_reg = modrm >> 6 == 3;
+        switch (code[0]) {
+            // add, or, and, sub, xor, cmp, test
+            case 0x00 ... 0x03: case 0x08 ... 0x0b: case 0x20 ... 0x23:
+            case 0x28 ... 0x2b: case 0x30 ... 0x33: case 0x38 ... 0x3b:
+            case 0x84: case 0x85:
+                return modrm_reg;
+            case 0x04: case 0x05: case 0x0c: case 0x0d: case 0x24: case 0x25:
+            case 0x2c: case 0x2d: case 0x34: case 0x35: case 0x3c: case 0x3d:
+            case 0xa8: case 0xa9:
+                return true;
+            case 0x80: case 0x81: case 0x83:
+                // but not adc or sbb, which read cf
+                return modrm_reg && (modrm >> 3 & 7) != 2 && (modrm >> 3 & 7) != 3;
+
+            // mov and lea
+            case 0x88 ... 0x8b:
+                if (!modrm_reg)
+                    return false;
+                ip += 2;
+                break;
+            case 0xb0 ... 0xb7:
+                ip += 2;
+                break;
+            case 0xb8 ... 0xbf:
+                ip += 5;
+                break;
+            case 0x8d: {
+                if (modrm_reg)
+                    return false;
+                int mod = modrm >> 6;
+                int base = modrm & 7;
+                ip += 2;
+                if (base == 4) {
+                    base = code[2] & 7;
+                    ip += 1;
+                }
+                if (mod == 1)
+                    ip += 1;
+                else if (mod == 2 || (mod == 0 && base == 5))
+                    ip += 4;
+                break;
+            }
+            case 0x90:
+                ip += 1;
+                break;
+
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
 #define load(thing, z) op(load, thing, z)
 #define store(thing, z) op(store, thing, z)
+// When an op reads and writes the same memory, the load translates the
+// address for writing and leaves the host pointer behind for the store, so
+// there's only one TLB lookup. Otherwise, a jump after it can use the result
+// the store left in a register.
+#define rmw_mem(dst) (arg_##dst == arg_modrm_val && modrm.type != modrm_reg)
+#define rmw_begin(dst, z) do { \
+    if (rmw_mem(dst)) { \
+        g_addr(); gz(rmw_load, z); GEN(state->orig_ip | state->orig_ip_extra); \
+    } else { \
+        load(dst, z); \
+    } \
+} while (0)
+#define rmw_end(dst, z) do { \
+    if (rmw_mem(dst)) { \
+        gz(rmw_store, z); GEN(state->orig_ip | state->orig_ip_extra); \
+    } else { \
+        store(dst, z); \
+        state->fuse_end = state->size; \
+    } \
+} while (0)
 // load-op-store
-#define los(o, src, dst, z) load(dst, z); op(o, src, z); store(dst, z)
+#define los(o, src, dst, z) rmw_begin(dst, z); op(o, src, z); rmw_end(dst, z)
 #define lo(o, src, dst, z) load(dst, z); op(o, src, z)
+// load-op-store, with a flagless version of the op if the flags are dead
+#define los_nf(o, src, dst, z) \
+    rmw_begin(dst, z); \
+    if (gen_flags_dead(state, tlb)) op(o##_noflags, src, z); else op(o, src, z); \
+    rmw_end(dst, z)
 
 #define MOV(src, dst,z) load(src, z); store(dst, z)
 #define MOVZX(src, dst,zs,zd) load(src, zs); gz(zero_extend, zs); store(dst, zd)
@@ -229,16 +446,16 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
 // xchg must generate in this order to be atomic
 #define XCHG(src, dst,z) load(src, z); op(xchg, dst, z); store(src, z)
 
-#define ADD(src, dst,z) los(add, src, dst, z)
-#define OR(src, dst,z) los(or, src, dst, z)
+#define ADD(src, dst,z) los_nf(add, src, dst, z)
+#define OR(src, dst,z) los_nf(or, src, dst, z)
 #define ADC(src, dst,z) los(adc, src, dst, z)
 #define SBB(src, dst,z) los(sbb, src, dst, z)
-#define AND(src, dst,z) los(and, src, dst, z)
-#define SUB(src, dst,z) los(sub, src, dst, z)
-#define XOR(src, dst,z) los(xor, src, dst, z)
-#define CMP(src, dst,z) lo(sub, src, dst, z)
-#define TEST(src, dst,z) lo(and, src, dst, z)
-#define NOT(val,z) load(val,z); gz(not, z); store(val,z)
+#define AND(src, dst,z) los_nf(and, src, dst, z)
+#define SUB(src, dst,z) los_nf(sub, src, dst, z)
+#define XOR(src, dst,z) los_nf(xor, src, dst, z)
+#define CMP(src, dst,z) lo(sub, src, dst, z); state->fuse_end = state->size
+#define TEST(src, dst,z) lo(and, src, dst, z); state->fuse_end = state->size
+#define NOT(val,z) rmw_begin(val, z); gz(not, z); rmw_end(val, z)
 #define NEG(val,z) imm = 0; load(imm,z); op(sub, val,z); store(val,z)
 
 #define POP(thing,z) \
@@ -247,19 +464,79 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
     store(thing, z)
 #define PUSH(thing,z) load(thing, z); gg(push, state->orig_ip)
 
-#define INC(val,z) load(val, z); gz(inc, z); store(val, z)
-#define DEC(val,z) load(val, z); gz(dec, z); store(val, z)
+#define INC(val,z) rmw_begin(val, z); if (gen_flags_dead(state, tlb)) gz(inc_noflags, z); else gz(inc, z); rmw_end(val, z)
+#define DEC(val,z) rmw_begin(val, z); if (gen_flags_dead(state, tlb)) gz(dec_noflags, z); else gz(dec, z); rmw_end(val, z)
 
 #define fake_ip (state->ip | (1ul << 63))
 
+// When building a trace, a direct jump to the next block in it doesn't end
+// the block, decoding carries on over there instead.
+static inline bool gen_trace_next(struct gen_state *state, unsigned long target) {
+    return state->trace != NULL && state->trace_pos + 1 < state->trace_len &&
+        (addr_t) target == state->trace[state->trace_pos + 1];
+}
+static inline void gen_trace_advance(struct gen_state *state) {
+    state->ip = state->start = state->trace[++state->trace_pos];
+}
+
 #define jump_ips(off1, off2) \
     state->jump_ip[0] = state->size + off1; \
     if (off2 != 0) \
         state->jump_ip[1] = state->size + off2
-#define JMP(loc) load(loc, OP_SIZE); g(jmp_indir); end_block = true
-#define JMP_REL(off) gg(jmp, fake_ip + off); jump_ips(-1, 0); end_block = true
+#define JMP(loc) do { \
+    load(loc, OP_SIZE); \
+    gg(jmp_indir, JIT_IC_EMPTY); \
+    state->jump_ip[1] = state->size - 1; \
+    end_block = true; \
+} while (0)
+#define JMP_REL(off) do { \
+    if (gen_trace_next(state, fake_ip + off)) { \
+        gen_trace_advance(state); \
+    } else { \
+        gg(jmp, fake_ip + off); jump_ips(-1, 0); end_block = true; \
+    } \
+} while (0)
+// cmp, test, or an op that leaves its result in a register, followed by a
+// conditional jump, gets the jump fused into its last gadget
+static bool gen_fuse_jcc(struct gen_state *state, enum cond cond) {
+    extern gadget_t sub_gadgets[], and_gadgets[], store_gadgets[];
+    extern gadget_t sub_jcc_gadgets[], and_jcc_gadgets[], store_jcc_gadgets[];
+    if (state->fuse_end == 0 || state->fuse_end != state->size || state->last_op_size != size_32)
+        return false;
+    gadget_t *fused;
+    if (state->last_op_type == sub_gadgets)
+        fused = sub_jcc_gadgets;
+    else if (state->last_op_type == and_gadgets)
+        fused = and_jcc_gadgets;
+    else if (state->last_op_type == store_gadgets)
+        fused = store_jcc_gadgets;
+    else
+        return false;
+    gadget_t gadget = fused[cond * arg_count + state->last_op_arg];
+    if (gadget == NULL)
+        return false;
+    state->block->code[state->last_op_ip] = (unsigned long) gadget;
+    return true;
+}
+
 #define JCXZ_REL(off) ggg(jcxz, fake_ip + off, fake_ip); jump_ips(-2, -1); end_block = true
-#define jcc(cc, to, else) gagg(jmp, cond_##cc, to, else); jump_ips(-2, -1); end_block = true
+// in a trace, the way that leaves the trace becomes a side exit that skips
+// over itself when it's not taken
+#define side_exit() \
+    state->side_exit_ip[state->side_exits_count++] = state->size - 1
+#define jcc(cc, to, not_to) do { \
+    if (gen_trace_next(state, to)) { \
+        gag(skip, cond_##cc, 2 * sizeof(long)); gg(jmp, not_to); side_exit(); \
+        gen_trace_advance(state); \
+    } else if (gen_trace_next(state, not_to)) { \
+        gag(skipn, cond_##cc, 2 * sizeof(long)); gg(jmp, to); side_exit(); \
+        gen_trace_advance(state); \
+    } else if (gen_fuse_jcc(state, cond_##cc)) { \
+        GEN(to); GEN(not_to); jump_ips(-2, -1); end_block = true; \
+    } else { \
+        gagg(jmp, cond_##cc, to, not_to); jump_ips(-2, -1); end_block = true; \
+    } \
+} while (0)
 #define J_REL(cc, off)  jcc(cc, fake_ip + off, fake_ip)
 #define JN_REL(cc, off) jcc(cc, fake_ip, fake_ip + off)
 
@@ -267,11 +544,12 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
 // -1: will be patched to block address in gen_end();
 // fake_ip: the first one is the return address, used for saving to stack and verifying the cached ip in return cache is correct;
 // fake_ip: the second one is the return target, patchable by return chaining.
+// JIT_IC_EMPTY: the inline cache for the call target.
 #define CALL(loc) do { \
     load(loc, OP_SIZE); \
-    ggggg(call_indir, state->orig_ip, -1, fake_ip, fake_ip); \
-    state->block_patch_ip = state->size - 3; \
-    jump_ips(-1, 0); \
+    gggggg(call_indir, state->orig_ip, -1, fake_ip, fake_ip, JIT_IC_EMPTY); \
+    state->block_patch_ip = state->size - 4; \
+    jump_ips(-2, -1); \
     end_block = true; \
 } while (0)
 // the first four arguments are the same with CALL,
@@ -343,6 +621,7 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
 #define BTR(bit, val,z) lo(btr, val, bit, z)
 #define BSF(src, dst,z) los(bsf, src, dst, z)
 #define BSR(src, dst,z) los(bsr, src, dst, z)
+#define POPCNT(src, dst,z) los(popcnt, src, dst, z)
 
 #define BSWAP(dst) ga(bswap, arg_##dst)
 
@@ -357,7 +636,8 @@ static inline bool gen_op(struct gen_state *state, gadget_t *gadgets, enum arg a
 #define XADD(src, dst,z) XCHG(src, dst,z); ADD(src, dst,z)
 
 void helper_rdtsc(struct cpu_state *cpu);
-#define RDTSC h(helper_rdtsc)
+// writes eax and edx in memory
+#define RDTSC h(helper_rdtsc); g(load_regs)
 #define CPUID() g(cpuid)
 
 // atomic
@@ -386,6 +666,7 @@ void helper_rdtsc(struct cpu_state *cpu);
 #define FLDM(val,z) h_read(fpu_ldm, z)
 #define FSTM(dst,z) h_write(fpu_stm, z)
 #define FIST(dst,z) h_write(fpu_ist, z)
+#define FISTT(dst,z) h_write(fpu_istt, z)
 #define FXCH() hh(fpu_xch, st_i)
 #define FCOM() hh(fpu_com, st_i)
 #define FCOMM(val,z) h_read(fpu_comm, z)
@@ -462,6 +743,49 @@ static inline uint16_t cpu_reg_offset(enum arg arg, int index) {
     return 0;
 }
 
+// The hottest SSE and MMX ops have gadgets that do the op on the host's
+// vector unit instead of calling the helper. They take the same arguments as
+// vec_helper_reg/vec_helper_read minus the helper pointer.
+#define VEC_NATIVE_OPS(_) \
+    _(add_b128) _(add_w128) _(add_d128) _(add_q128) \
+    _(sub_b128) _(sub_w128) _(sub_d128) _(sub_q128) \
+    _(and_dq128) _(or_dq128) _(xor_dq128) _(andn128) \
+    _(compare_eqb128) _(compare_eqw128) _(compare_eqd128) \
+    _(compares_gtb128) _(compares_gtw128) _(compares_gtd128) \
+    _(min_ub128) _(max_ub128) \
+    _(add_p32) _(sub_p32) _(mul_p32) _(add_p64) _(sub_p64) _(mul_p64) \
+    _(shuffle_d128) _(movmask_b128) \
+    _(add_b64) _(add_w64) _(add_d64) _(add_q64) \
+    _(sub_b64) _(sub_w64) _(sub_d64) _(sub_q64) \
+    _(and_q64) _(or_q64) _(xor_q64) \
+    _(compare_eqb64) _(compare_eqw64) _(compare_eqd64) \
+    _(compares_gtb64) _(compares_gtw64) _(compares_gtd64) \
+    _(movmask_b64)
+#define VEC_NATIVE_DECL(op) \
+    extern void gadget_vec_##op##_reg(void); \
+    extern void gadget_vec_##op##_mem(void);
+VEC_NATIVE_OPS(VEC_NATIVE_DECL)
+#undef VEC_NATIVE_DECL
+
+struct vec_native {
+    void (*helper)();
+    gadget_t reg;
+    gadget_t mem;
+};
+static const struct vec_native *gen_vec_native(void (*helper)()) {
+#define VEC_NATIVE_ENTRY(op) \
+    {(void (*)()) vec_##op, gadget_vec_##op##_reg, gadget_vec_##op##_mem},
+    static const struct vec_native natives[] = {
+        VEC_NATIVE_OPS(VEC_NATIVE_ENTRY)
+    };
+#undef VEC_NATIVE_ENTRY
+    for (unsigned i = 0; i < array_size(natives); i++) {
+        if (natives[i].helper == helper)
+            return &natives[i];
+    }
+    return NULL;
+}
+
 static inline bool gen_vec(enum arg src, enum arg dst, void (*helper)(), gadget_t read_mem_gadget, gadget_t write_mem_gadget, struct gen_state *state, struct modrm *modrm, uint8_t imm, bool seg_gs, bool has_imm) {
     bool rm_is_src = !could_be_memory(dst);
     enum arg rm = rm_is_src ? src : dst;
@@ -473,21 +797,33 @@ static inline bool gen_vec(enum arg src, enum arg dst, void (*helper)(), gadget_
 
     if (could_be_memory(rm) && modrm->type != modrm_reg)
         rm = arg_mem;
+    // helpers find general purpose registers in memory, where they usually
+    // aren't
+    bool sync_regs = reg == arg_modrm_reg || reg == arg_modrm_val ||
+        rm == arg_modrm_reg || rm == arg_modrm_val;
+    if (sync_regs)
+        g(save_regs);
 
     uint64_t imm_arg = 0;
     if (has_imm)
         imm_arg = (uint64_t) imm << 32;
+    const struct vec_native *native = rm_is_src ? gen_vec_native(helper) : NULL;
 
     switch (rm) {
         case arg_xmm_modrm_val:
         case arg_mm_modrm_val:
         case arg_modrm_val:
             assert(rm_reg_offset != 0);
+            if (native != NULL && rm != arg_modrm_val) {
+                GEN_GADGET(native->reg);
+                GEN(rm_reg_offset | (reg_offset << 16) | imm_arg);
+                break;
+            }
             if (!has_imm)
                 g(vec_helper_reg);
             else
                 g(vec_helper_reg_imm);
-            GEN(helper);
+            GEN_HOST(helper);
             // first byte is src, second byte is dst
             uint64_t arg;
             if (rm_is_src)
@@ -499,22 +835,30 @@ static inline bool gen_vec(enum arg src, enum arg dst, void (*helper)(), gadget_
 
         case arg_mem:
             gen_addr(state, modrm, seg_gs);
-            GEN(rm_is_src ? read_mem_gadget : write_mem_gadget);
+            if (native != NULL) {
+                GEN_GADGET(native->mem);
+                GEN(state->orig_ip);
+                GEN(reg_offset | imm_arg);
+                break;
+            }
+            GEN_GADGET(rm_is_src ? read_mem_gadget : write_mem_gadget);
             GEN(state->orig_ip);
-            GEN(helper);
+            GEN_HOST(helper);
             GEN(reg_offset | imm_arg);
             break;
 
         case arg_imm:
             // TODO: support immediates and opcode
             g(vec_helper_imm);
-            GEN(helper);
+            GEN_HOST(helper);
             // This is rm_opcode instead of opcode because PSRLQ is weird like that
             GEN(((uint16_t) imm) | (cpu_reg_offset(reg, modrm->rm_opcode) << 16));
             break;
 
         default: die("unimplemented vecarg");
     }
+    if (sync_regs)
+        g(load_regs);
     return true;
 }
 
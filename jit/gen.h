@@ -7,17 +7,52 @@
 struct gen_state {
     addr_t ip;
     addr_t orig_ip;
+    // where decoding of the current basic block started, which is only
+    // different from block->addr in a trace
+    addr_t start;
     unsigned long orig_ip_extra;
+    // the block is compiled in a malloced buffer and moved into one of this
+    // jit's arenas by gen_end
+    struct jit *jit;
     struct jit_block *block;
     unsigned size;
     unsigned capacity;
     unsigned jump_ip[2];
     unsigned block_patch_ip; // for call/call_indir gadgets
+    // the last gadget generated by gen_op, so a conditional jump right after
+    // it can be fused into it. fuse_end is where the code was when an
+    // instruction that can be fused with a jump finished generating.
+    const void *last_op_type;
+    int last_op_arg;
+    int last_op_size;
+    unsigned last_op_ip;
+    unsigned fuse_end;
+    // the generated code depends on more than the guest code bytes (a fault
+    // address was baked in), so it can't be shared
+    bool segfaulted;
+    // every instruction has to leave the flags behind like it should, e.g.
+    // because it's being single stepped
+    bool precise_flags;
+    // bitmap of the words in code that are host pointers (gadgets and
+    // helpers), so the block can be written out in a relocatable form
+    unsigned long *host_ptrs;
+    // bitmap of the words in code that are gadgets
+    unsigned long *gadgets;
+    // for superblocks: start addresses of the blocks to string together, and
+    // which of them is being decoded
+    const addr_t *trace;
+    unsigned trace_len;
+    unsigned trace_pos;
+    // where the side exits' targets are in code
+    unsigned side_exit_ip[JIT_TRACE_MAX_BLOCKS];
+    unsigned side_exits_count;
 };
 
-void gen_start(addr_t addr, struct gen_state *state);
+void gen_start(struct jit *jit, addr_t addr, struct gen_state *state);
 void gen_exit(struct gen_state *state);
 void gen_end(struct gen_state *state);
+// frees what gen_end leaves behind in the state
+void gen_free(struct gen_state *state);
 
 int gen_step(struct gen_state *state, struct tlb *tlb);
 
@@ -1,6 +1,7 @@
 #include <time.h>
 #include "emu/cpu.h"
 #include "emu/cpuid.h"
+#include "emu/tlb.h"
 
 void helper_cpuid(dword_t *a, dword_t *b, dword_t *c, dword_t *d) {
     do_cpuid(a, b, c, d);
@@ -21,3 +22,107 @@ void helper_expand_flags(struct cpu_state *cpu) {
 void helper_collapse_flags(struct cpu_state *cpu) {
     collapse_flags(cpu);
 }
+
+// Bulk versions of rep string instructions going forwards, which the string
+// gadgets call before their element by element loop. They go a page at a
+// time and leave to that loop whatever it has to deal with itself: an
+// element straddling two pages, a fault, and for cmps and scas the element
+// that ends the repeat, since that one sets the flags.
+
+static unsigned rep_elements(addr_t addr, unsigned size, unsigned count) {
+    unsigned n = (PAGE_SIZE - PGOFFSET(addr)) / size;
+    return n < count ? n : count;
+}
+
+void helper_rep_movs(struct cpu_state *cpu, struct tlb *tlb, unsigned size) {
+    // copying one element at a time repeats the start of the source when the
+    // destination overlaps the end of it, which memmove doesn't do
+    if (cpu->edi != cpu->esi && (dword_t) (cpu->edi - cpu->esi) < (uint64_t) cpu->ecx * size)
+        return;
+    while (cpu->ecx != 0) {
+        unsigned n = rep_elements(cpu->edi, size, rep_elements(cpu->esi, size, cpu->ecx));
+        if (n == 0)
+            return;
+        const void *src = __tlb_read_ptr(tlb, cpu->esi);
+        if (src == NULL)
+            return;
+        void *dst = __tlb_write_ptr(tlb, cpu->edi);
+        if (dst == NULL)
+            return;
+        memmove(dst, src, n * size);
+        cpu->esi += n * size;
+        cpu->edi += n * size;
+        cpu->ecx -= n;
+    }
+}
+
+void helper_rep_stos(struct cpu_state *cpu, struct tlb *tlb, unsigned size) {
+    dword_t mask = size == 4 ? 0xffffffff : (1u << size * 8) - 1;
+    dword_t value = cpu->eax & mask;
+    bool bytes_same = value == ((cpu->eax & 0xff) * 0x01010101u & mask);
+    while (cpu->ecx != 0) {
+        unsigned n = rep_elements(cpu->edi, size, cpu->ecx);
+        if (n == 0)
+            return;
+        char *dst = __tlb_write_ptr(tlb, cpu->edi);
+        if (dst == NULL)
+            return;
+        if (bytes_same) {
+            memset(dst, value & 0xff, n * size);
+        } else {
+            for (unsigned i = 0; i < n; i++)
+                memcpy(dst + i * size, &value, size);
+        }
+        cpu->edi += n * size;
+        cpu->ecx -= n;
+    }
+}
+
+void helper_rep_scas(struct cpu_state *cpu, struct tlb *tlb, unsigned size, bool repnz) {
+    while (cpu->ecx > 1) {
+        unsigned n = rep_elements(cpu->edi, size, cpu->ecx - 1);
+        if (n == 0)
+            return;
+        const char *p = __tlb_read_ptr(tlb, cpu->edi);
+        if (p == NULL)
+            return;
+        unsigned i = 0;
+        if (size == 1 && repnz) {
+            const char *found = memchr(p, cpu->eax & 0xff, n);
+            i = found != NULL ? found - p : n;
+        } else {
+            while (i < n && (memcmp(p + i * size, &cpu->eax, size) == 0) != repnz)
+                i++;
+        }
+        cpu->edi += i * size;
+        cpu->ecx -= i;
+        if (i < n)
+            return;
+    }
+}
+
+void helper_rep_cmps(struct cpu_state *cpu, struct tlb *tlb, unsigned size, bool repnz) {
+    while (cpu->ecx > 1) {
+        unsigned n = rep_elements(cpu->edi, size, rep_elements(cpu->esi, size, cpu->ecx - 1));
+        if (n == 0)
+            return;
+        const char *a = __tlb_read_ptr(tlb, cpu->esi);
+        if (a == NULL)
+            return;
+        const char *b = __tlb_read_ptr(tlb, cpu->edi);
+        if (b == NULL)
+            return;
+        unsigned i = 0;
+        if (!repnz && memcmp(a, b, n * size) == 0) {
+            i = n;
+        } else {
+            while (i < n && (memcmp(a + i * size, b + i * size, size) == 0) != repnz)
+                i++;
+        }
+        cpu->esi += i * size;
+        cpu->edi += i * size;
+        cpu->ecx -= i;
+        if (i < n)
+            return;
+    }
+}
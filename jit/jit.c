@@ -14,17 +14,296 @@ extern int current_pid(void);
 
 static void jit_block_disconnect(struct jit *jit, struct jit_block *block);
 static void jit_block_free(struct jit *jit, struct jit_block *block);
-static void jit_free_jetsam(struct jit *jit);
-static void jit_resize_hash(struct jit *jit, size_t new_size);
+static void jit_free_jetsam(struct jit *jit, uint64_t before);
+static bool jit_compile_idle(struct jit *jit);
+
+static uint64_t jit_next_id = 0;
+
+#ifndef JIT_MEM_LIMIT
+#define JIT_MEM_LIMIT 32
+#endif
+#ifndef JIT_GLOBAL_MEM_LIMIT
+#define JIT_GLOBAL_MEM_LIMIT 128
+#endif
+
+size_t jit_mem_limit = (size_t) JIT_MEM_LIMIT << 20;
+size_t jit_global_mem_limit = (size_t) JIT_GLOBAL_MEM_LIMIT << 20;
+size_t jit_global_mem_used;
+uint64_t jit_global_evictions;
+
+// Per-thread execution state that outlives a single cpu_step_to_interrupt, so
+// the dispatch cache and the return cache stay warm across syscalls and
+// faults. Everything in here points into one jit, so it's thrown out when the
+// jit, its epoch, or the address space layout changes.
+struct jit_thread {
+    uint64_t jit_id;
+    uint64_t epoch;
+    uint64_t mem_changes;
+    struct jit_frame frame;
+    struct jit_block *cache[JIT_CACHE_SIZE];
+    struct jit_stats stats;
+    struct list threads;
+};
+
+static __thread struct jit_thread *jit_thread;
+static pthread_key_t jit_thread_key;
+
+// Every jit_thread, for adding up their stats, and the counts of the ones
+// that are gone. The owning thread changes its counters without the lock, so
+// a read can be a few increments behind. This is a plain mutex since threads
+// take it on their way out, when they may no longer have a task.
+static struct {
+    struct list threads;
+    struct jit_stats retired;
+    pthread_mutex_t lock;
+} jit_stats_all = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void jit_stats_add(struct jit_stats *stats, struct jit_stats *other) {
+    uint64_t *dst = (uint64_t *) stats;
+    uint64_t *src = (uint64_t *) other;
+    for (size_t i = 0; i < sizeof(struct jit_stats) / sizeof(uint64_t); i++)
+        dst[i] += src[i];
+}
+
+void jit_stats_collect(struct jit *jit, struct jit_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&jit_stats_all.lock);
+    if (jit == NULL)
+        jit_stats_add(stats, &jit_stats_all.retired);
+    struct jit_thread *thread;
+    list_for_each_entry(&jit_stats_all.threads, thread, threads) {
+        if (jit == NULL || thread->jit_id == jit->id)
+            jit_stats_add(stats, &thread->stats);
+    }
+    pthread_mutex_unlock(&jit_stats_all.lock);
+}
+
+// the counts so far were for the old jit, so they go to the totals
+static void jit_thread_set_jit(struct jit_thread *thread, uint64_t jit_id) {
+    pthread_mutex_lock(&jit_stats_all.lock);
+    jit_stats_add(&jit_stats_all.retired, &thread->stats);
+    memset(&thread->stats, 0, sizeof(thread->stats));
+    thread->jit_id = jit_id;
+    pthread_mutex_unlock(&jit_stats_all.lock);
+}
+
+static void jit_thread_destroy(void *data) {
+    struct jit_thread *thread = data;
+    pthread_mutex_lock(&jit_stats_all.lock);
+    jit_stats_add(&jit_stats_all.retired, &thread->stats);
+    list_remove(&thread->threads);
+    pthread_mutex_unlock(&jit_stats_all.lock);
+    free(thread);
+}
+
+__attribute__((constructor)) static void jit_thread_key_init() {
+    pthread_key_create(&jit_thread_key, jit_thread_destroy);
+    list_init(&jit_stats_all.threads);
+}
+
+static struct jit_thread *jit_thread_get(void) {
+    if (jit_thread == NULL) {
+        jit_thread = malloc(sizeof(struct jit_thread));
+        // id 0 is never handed out, so the first use always resets
+        jit_thread->jit_id = 0;
+        memset(&jit_thread->stats, 0, sizeof(jit_thread->stats));
+        pthread_mutex_lock(&jit_stats_all.lock);
+        list_add(&jit_stats_all.threads, &jit_thread->threads);
+        pthread_mutex_unlock(&jit_stats_all.lock);
+        pthread_setspecific(jit_thread_key, jit_thread);
+    }
+    return jit_thread;
+}
+
+// for counting outside of the dispatcher
+#define jit_stat(name) (jit_thread_get()->stats.name)
+
+static inline uint64_t jit_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void jit_thread_flush(struct jit_thread *thread) {
+    memset(thread->cache, 0, sizeof(thread->cache));
+    memset(thread->frame.ret_stack, 0, sizeof(thread->frame.ret_stack));
+    thread->frame.ret_top = 0;
+    thread->frame.last_block = NULL;
+    thread->frame.ic_miss = NULL;
+}
+
+// Announce that this thread is running code from the jit in the current
+// epoch. Retry if the epoch moved between reading it and being counted,
+// otherwise an advance could miss us.
+static uint64_t jit_epoch_enter(struct jit *jit) {
+    while (true) {
+        uint64_t epoch = __atomic_load_n(&jit->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&jit->active[epoch % 3], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&jit->epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&jit->active[epoch % 3], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void jit_epoch_exit(struct jit *jit, uint64_t epoch) {
+    __atomic_sub_fetch(&jit->active[epoch % 3], 1, __ATOMIC_SEQ_CST);
+}
+
+// Must be called with jit->lock held, which keeps advances serialized.
+static void jit_epoch_try_advance(struct jit *jit) {
+    uint64_t epoch = jit->epoch;
+    if (__atomic_load_n(&jit->active[(epoch - 1) % 3], __ATOMIC_SEQ_CST) == 0)
+        __atomic_store_n(&jit->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+// The block table is open addressed with linear probing, so finding a block
+// is a few loads with no lock. Changes are made with jit->lock held, and are
+// single stores of a slot, so readers always see either the old or the new
+// block there. Removed blocks leave a tombstone behind. Instead of resizing
+// in place, a new table is built on the side and swapped in, and the old one
+// is kept around until every thread that could be reading it has moved on,
+// the same way as blocks.
+struct jit_table {
+    size_t size; // a power of 2
+    // for old_tables
+    struct list old;
+    uint64_t retired_epoch;
+    struct jit_block *slots[];
+};
+#define JIT_TABLE_TOMBSTONE ((struct jit_block *) 1)
+
+size_t jit_hash_size(struct jit *jit) {
+    return __atomic_load_n(&jit->table, __ATOMIC_ACQUIRE)->size;
+}
+
+static struct jit_table *jit_table_new(size_t size) {
+    struct jit_table *table = calloc(1, sizeof(struct jit_table) + size * sizeof(struct jit_block *));
+    table->size = size;
+    return table;
+}
+
+static inline size_t jit_table_hash(struct jit_table *table, addr_t addr) {
+    return (addr ^ (addr >> 12)) & (table->size - 1);
+}
+
+// Returns true if this reused a tombstone
+static bool jit_table_add(struct jit_table *table, struct jit_block *block) {
+    for (size_t i = jit_table_hash(table, block->addr);; i = (i + 1) & (table->size - 1)) {
+        struct jit_block *slot = table->slots[i];
+        if (slot == NULL || slot == JIT_TABLE_TOMBSTONE) {
+            __atomic_store_n(&table->slots[i], block, __ATOMIC_RELEASE);
+            return slot == JIT_TABLE_TOMBSTONE;
+        }
+    }
+}
+
+static void jit_table_remove(struct jit *jit, struct jit_block *block) {
+    struct jit_table *table = jit->table;
+    for (size_t i = jit_table_hash(table, block->addr);; i = (i + 1) & (table->size - 1)) {
+        struct jit_block *slot = table->slots[i];
+        if (slot == NULL)
+            return;
+        if (slot == block) {
+            __atomic_store_n(&table->slots[i], JIT_TABLE_TOMBSTONE, __ATOMIC_RELEASE);
+            jit->table_tombstones++;
+            return;
+        }
+    }
+}
+
+static void jit_table_rebuild(struct jit *jit, size_t new_size) {
+    TRACE_(verbose, "%d resizing table to %lu, using %lu bytes for gadgets\n", current_pid(), new_size, jit->mem_used);
+    struct jit_table *old = jit->table;
+    struct jit_table *table = jit_table_new(new_size);
+    for (size_t i = 0; i < old->size; i++) {
+        if (old->slots[i] != NULL && old->slots[i] != JIT_TABLE_TOMBSTONE)
+            jit_table_add(table, old->slots[i]);
+    }
+    __atomic_store_n(&jit->table, table, __ATOMIC_RELEASE);
+    jit->table_tombstones = 0;
+    old->retired_epoch = jit->epoch;
+    list_add(&jit->old_tables, &old->old);
+    jit_epoch_try_advance(jit);
+}
+
+struct jit_arena {
+    struct jit *jit;
+    struct list arenas;
+    size_t size;
+    size_t used;
+    // blocks allocated here and not freed yet, including jetsam
+    size_t live;
+    unsigned long data[];
+};
+
+struct jit_block *jit_arena_alloc(struct jit *jit, size_t size) {
+    struct jit_block *block;
+    if (jit == NULL) {
+        block = malloc(size);
+        if (block == NULL)
+            die("out of memory while jitting");
+        block->arena = NULL;
+        return block;
+    }
+
+    lock(&jit->arena_lock, 0);
+    struct jit_arena *arena = jit->arena;
+    if (arena == NULL || arena->used + size > arena->size) {
+        size_t arena_size = size > JIT_ARENA_SIZE ? size : JIT_ARENA_SIZE;
+        arena = malloc(sizeof(struct jit_arena) + arena_size);
+        if (arena == NULL)
+            die("out of memory while jitting");
+        arena->jit = jit;
+        arena->size = arena_size;
+        arena->used = 0;
+        arena->live = 0;
+        list_add(&jit->arenas, &arena->arenas);
+        // the old one goes away when its last block does
+        struct jit_arena *old = jit->arena;
+        if (old != NULL && old->live == 0) {
+            list_remove(&old->arenas);
+            free(old);
+        }
+        jit->arena = arena;
+    }
+    block = (struct jit_block *) ((char *) arena->data + arena->used);
+    arena->used += size;
+    arena->live++;
+    unlock(&jit->arena_lock);
+    block->arena = arena;
+    return block;
+}
+
+void jit_arena_free(struct jit_block *block) {
+    struct jit_arena *arena = block->arena;
+    if (arena == NULL) {
+        free(block);
+        return;
+    }
+    struct jit *jit = arena->jit;
+    lock(&jit->arena_lock, 0);
+    if (--arena->live == 0) {
+        if (arena == jit->arena) {
+            arena->used = 0;
+        } else {
+            list_remove(&arena->arenas);
+            free(arena);
+        }
+    }
+    unlock(&jit->arena_lock);
+}
 
 struct jit *jit_new(struct mmu *mmu) {
     struct jit *jit = calloc(1, sizeof(struct jit));
     jit->mmu = mmu;
-    jit_resize_hash(jit, JIT_INITIAL_HASH_SIZE);
-    jit->page_hash = calloc(JIT_PAGE_HASH_SIZE, sizeof(*jit->page_hash));
+    jit->table = jit_table_new(JIT_INITIAL_HASH_SIZE);
+    list_init(&jit->old_tables);
     list_init(&jit->jetsam);
+    list_init(&jit->arenas);
+    lock_init(&jit->arena_lock, "jit_arena\0");
+    jit->id = __atomic_add_fetch(&jit_next_id, 1, __ATOMIC_RELAXED);
+    jit->epoch = 1;
     lock_init(&jit->lock, "jit_new\0");
-    wrlock_init(&jit->jetsam_lock);
     return jit;
 }
 
@@ -36,105 +315,381 @@ void jit_free(struct jit *jit) {
         nanosleep(&lock_pause, NULL);
         signal_pending = !!(current->pending & ~current->blocked);
     }
-    for (size_t i = 0; i < jit->hash_size; i++) {
-        struct jit_block *block, *tmp;
-        if (list_null(&jit->hash[i]))
-            continue;
-        list_for_each_entry_safe(&jit->hash[i], block, tmp, chain) {
-            jit_block_free(jit, block);
-        }
+    // wait for any thread still running blocks from this jit or compiling
+    // for it
+    while (!jit_compile_idle(jit))
+        nanosleep(&lock_pause, NULL);
+    // every block in the table or on jetsam is in an arena, and the page
+    // lists they're on go away with the mem, so no need to unlink them
+    struct jit_arena *arena, *tmp_arena;
+    list_for_each_entry_safe(&jit->arenas, arena, tmp_arena, arenas) {
+        list_remove(&arena->arenas);
+        free(arena);
+    }
+    struct jit_table *table, *tmp_table;
+    list_for_each_entry_safe(&jit->old_tables, table, tmp_table, old) {
+        list_remove(&table->old);
+        free(table);
     }
-    jit_free_jetsam(jit);
     unlock(&jit->lock);
-    free(jit->page_hash);
-    free(jit->hash);
-    write_lock(&jit->jetsam_lock);
+    free(jit->table);
     free(jit);
 }
 
-static inline struct list *blocks_list(struct jit *jit, page_t page, int i) {
-    // TODO is this a good hash function?
-    return &jit->page_hash[page % JIT_PAGE_HASH_SIZE].blocks[i];
+static inline struct pt_entry *jit_pt(struct jit *jit, page_t page) {
+    return mem_pt(container_of(jit->mmu, struct mem, mmu), page);
 }
 
-void jit_invalidate_range(struct jit *jit, page_t start, page_t end) {
+static void jit_block_retire(struct jit *jit, struct jit_block *block) {
+    jit_block_disconnect(jit, block);
+    block->is_jetsam = true;
+    block->jetsam_epoch = jit->epoch;
+    list_add(&jit->jetsam, &block->jetsam);
+}
+
+// Returns how many blocks were invalidated
+static uint64_t jit_invalidate_pages(struct jit *jit, page_t start, page_t end) {
+    struct mem *mem = container_of(jit->mmu, struct mem, mmu);
     lock(&jit->lock, 0);
-    struct jit_block *block, *tmp;
-    for (page_t page = start; page < end; page++) {
-        for (int i = 0; i <= 1; i++) {
-            struct list *blocks = blocks_list(jit, page, i);
-            if (list_null(blocks))
+    uint64_t invalidated = 0;
+    if (end - start > jit->num_blocks) {
+        // cheaper to go through every block than every page
+        __atomic_add_fetch(&jit->invalidations, 1, __ATOMIC_SEQ_CST);
+        struct jit_table *table = jit->table;
+        for (size_t i = 0; i < table->size; i++) {
+            struct jit_block *block = table->slots[i];
+            if (block == NULL || block == JIT_TABLE_TOMBSTONE)
                 continue;
-            list_for_each_entry_safe(blocks, block, tmp, page[i]) {
-                jit_block_disconnect(jit, block);
-                block->is_jetsam = true;
-                list_add(&jit->jetsam, &block->jetsam);
+            // a trace's end_addr can be on a lower page than its addr, so
+            // check the two pages on their own
+            page_t first = PAGE(block->addr);
+            page_t last = PAGE(block->end_addr);
+            if ((first < start || first >= end) && (last < start || last >= end))
+                continue;
+            jit_block_retire(jit, block);
+            invalidated++;
+        }
+    } else {
+        for (page_t page = start; page < end; mem_next_page(mem, &page)) {
+            struct pt_entry *entry = mem_pt(mem, page);
+            if (entry == NULL)
+                continue;
+            __atomic_add_fetch(&entry->jit_invalidations, 1, __ATOMIC_SEQ_CST);
+            struct jit_block *block, *tmp;
+            for (int i = 0; i <= 1; i++) {
+                if (list_null(&entry->blocks[i]))
+                    continue;
+                list_for_each_entry_safe(&entry->blocks[i], block, tmp, page[i]) {
+                    jit_block_retire(jit, block);
+                    invalidated++;
+                }
             }
         }
     }
+    // get running threads to drop their cached pointers to the old code
+    if (invalidated)
+        jit_epoch_try_advance(jit);
     unlock(&jit->lock);
+    return invalidated;
+}
+
+void jit_invalidate_range(struct jit *jit, page_t start, page_t end) {
+    jit_stat(invalidated_unmap) += jit_invalidate_pages(jit, start, end);
 }
 
+// Whether any blocks are in the page's lists. Read without the lock, see
+// jit_insert_fresh for why that's fine.
+static bool jit_page_has_code(struct pt_entry *entry) {
+    for (int i = 0; i <= 1; i++) {
+        struct list *next = __atomic_load_n(&entry->blocks[i].next, __ATOMIC_SEQ_CST);
+        if (next != NULL && next != &entry->blocks[i])
+            return true;
+    }
+    return false;
+}
+
+// Called on every write fault, so writes to data pages shouldn't have to take
+// the lock. Bumping the count is enough to keep a compile that's running at
+// the same time from inserting blocks made from the old code.
 void jit_invalidate_page(struct jit *jit, page_t page) {
-    while(critical_region_count(current) > 4) { // It's all a bit magic, but I think this is doing something useful.  -mke
-        nanosleep(&lock_pause, NULL);
+    struct pt_entry *entry = jit_pt(jit, page);
+    if (entry != NULL) {
+        __atomic_add_fetch(&entry->jit_invalidations, 1, __ATOMIC_SEQ_CST);
+        if (!jit_page_has_code(entry))
+            return;
     }
-    //modify_critical_region_counter(current, 1, __FILE__, __LINE__);
-    jit_invalidate_range(jit, page, page + 1);
-    //modify_critical_region_counter(current, -1, __FILE__, __LINE__);
+    jit_stat(invalidated_write) += jit_invalidate_pages(jit, page, page + 1);
 }
 
 void jit_invalidate_all(struct jit *jit) {
     jit_invalidate_range(jit, 0, MEM_PAGES);
 }
 
-static void jit_resize_hash(struct jit *jit, size_t new_size) {
-    TRACE_(verbose, "%d resizing hash to %lu, using %lu bytes for gadgets\n", current_pid(), new_size, jit->mem_used);
-    struct list *new_hash = calloc(new_size, sizeof(struct list));
-    for (size_t i = 0; i < jit->hash_size; i++) {
-        if (list_null(&jit->hash[i]))
+static inline size_t jit_block_size(struct jit_block *block) {
+    return sizeof(struct jit_block) + block->used * sizeof(unsigned long);
+}
+
+// Second chance eviction. The clock hand goes around the table slots, and
+// a block gets evicted if nothing has dispatched to it since the hand last
+// went by. Chained jumps don't go through the dispatcher, so a block only
+// reached that way looks cold, but evicting it unchains it and the next
+// jump there marks the new copy. Goes down to 7/8 of the limit so this
+// doesn't run on every insert. Evicting for the global limit takes from the
+// inserting jit, since other jits can't be touched without their locks.
+// Must be called with jit->lock held.
+static void jit_evict(struct jit *jit) {
+    size_t excess = 0;
+    if (jit_mem_limit != 0 && jit->mem_used > jit_mem_limit)
+        excess = jit->mem_used - jit_mem_limit / 8 * 7;
+    size_t global_used = __atomic_load_n(&jit_global_mem_used, __ATOMIC_RELAXED);
+    if (jit_global_mem_limit != 0 && global_used > jit_global_mem_limit &&
+            global_used - jit_global_mem_limit / 8 * 7 > excess)
+        excess = global_used - jit_global_mem_limit / 8 * 7;
+    if (excess == 0)
+        return;
+
+    struct jit_table *table = jit->table;
+    size_t freed = 0;
+    uint64_t evictions = 0;
+    // twice around clears every reference bit, so it's sure to find blocks
+    for (size_t n = 0; n < table->size * 2 && freed < excess; n++) {
+        struct jit_block *block = table->slots[jit->clock_hand++ & (table->size - 1)];
+        if (block == NULL || block == JIT_TABLE_TOMBSTONE)
+            continue;
+        if (block->referenced) {
+            block->referenced = false;
             continue;
-        struct jit_block *block, *tmp;
-        list_for_each_entry_safe(&jit->hash[i], block, tmp, chain) {
-            list_remove(&block->chain);
-            list_init_add(&new_hash[block->addr % new_size], &block->chain);
         }
+        freed += jit_block_size(block);
+        jit_block_retire(jit, block);
+        evictions++;
     }
-    free(jit->hash);
-    jit->hash = new_hash;
-    jit->hash_size = new_size;
+    if (evictions == 0)
+        return;
+    TRACE_(verbose, "%d evicted %llu blocks, %lu bytes\n", current_pid(), (unsigned long long) evictions, freed);
+    jit->evictions += evictions;
+    __atomic_add_fetch(&jit_global_evictions, evictions, __ATOMIC_RELAXED);
+    jit_epoch_try_advance(jit);
 }
 
 static void jit_insert(struct jit *jit, struct jit_block *block) {
-    jit->mem_used += block->used;
+    jit_evict(jit);
+    jit->mem_used += jit_block_size(block);
+    __atomic_add_fetch(&jit_global_mem_used, jit_block_size(block), __ATOMIC_RELAXED);
     jit->num_blocks++;
-    // target an average hash chain length of 1-2
-    if (jit->num_blocks >= jit->hash_size * 2)
-        jit_resize_hash(jit, jit->hash_size * 2);
+    // keep the table at most half full, counting tombstones, which only go
+    // away in a rebuild
+    size_t size = jit->table->size;
+    if ((jit->num_blocks + jit->table_tombstones) * 2 >= size)
+        jit_table_rebuild(jit, jit->num_blocks * 4 >= size ? size * 2 : size);
+    if (jit_table_add(jit->table, block))
+        jit->table_tombstones--;
 
-    list_init_add(&jit->hash[block->addr % jit->hash_size], &block->chain);
-    list_init_add(blocks_list(jit, PAGE(block->addr), 0), &block->page[0]);
-    if (PAGE(block->addr) != PAGE(block->end_addr))
-        list_init_add(blocks_list(jit, PAGE(block->end_addr), 1), &block->page[1]);
+    // the code was just read from these pages, and they can't be unmapped
+    // while the mem is read locked, so they're there
+    bool new_code = false;
+    for (int i = 0; i <= 1; i++) {
+        page_t page = PAGE(i == 0 ? block->addr : block->end_addr);
+        if (i == 1 && page == PAGE(block->addr))
+            break;
+        struct pt_entry *entry = jit_pt(jit, page);
+        if (entry != NULL) {
+            if (!jit_page_has_code(entry))
+                new_code = true;
+            list_init_add(&entry->blocks[i], &block->page[i]);
+        }
+    }
+    // Writes that hit the TLB don't get to jit_invalidate_page, so a page
+    // that just got its first block makes every TLB drop its write entries.
+    if (new_code)
+        __atomic_add_fetch(&jit->mmu->changes, 1, __ATOMIC_SEQ_CST);
 }
 
+// Doesn't need the lock, only to be in an epoch
 static struct jit_block *jit_lookup(struct jit *jit, addr_t addr) {
-    struct list *bucket = &jit->hash[addr % jit->hash_size];
-    if (list_null(bucket))
-        return NULL;
-    struct jit_block *block;
-    list_for_each_entry(bucket, block, chain) {
-        if (block->addr == addr)
+    struct jit_table *table = __atomic_load_n(&jit->table, __ATOMIC_ACQUIRE);
+    for (size_t i = jit_table_hash(table, addr);; i = (i + 1) & (table->size - 1)) {
+        struct jit_block *block = __atomic_load_n(&table->slots[i], __ATOMIC_ACQUIRE);
+        if (block == NULL)
+            return NULL;
+        // an old table can still have blocks that were retired since
+        if (block != JIT_TABLE_TOMBSTONE && block->addr == addr && !block->is_jetsam)
             return block;
     }
-    return NULL;
 }
 
-static struct jit_block *jit_block_compile(addr_t ip, struct tlb *tlb) {
+// Translations only depend on the guest code bytes and the address they're
+// at, so a block compiled in one address space can be copied into any other
+// that has the same code at the same address. This saves decoding ld.so and
+// busybox over again in every process of a shell pipeline. Only code from
+// pages that aren't writable gets published, and the guest bytes are compared
+// on every hit, so a different program loaded at the same address never
+// matches. Hits are copied out under the lock, so templates need no refcount.
+static struct {
+    struct list hash[JIT_SHARED_HASH_SIZE];
+    // oldest first, for eviction
+    struct list fifo;
+    size_t mem_used;
+    lock_t lock;
+} jit_shared;
+
+__attribute__((constructor)) static void jit_shared_init() {
+    list_init(&jit_shared.fifo);
+    lock_init(&jit_shared.lock, "jit_shared\0");
+}
+
+struct jit_template *jit_template_new(addr_t addr, unsigned guest_size, unsigned size) {
+    size_t mem_used = sizeof(struct jit_template) +
+        (size + BITMAP_WORDS(size) * 2) * sizeof(unsigned long) + guest_size;
+    struct jit_template *template = malloc(mem_used);
+    if (template == NULL)
+        return NULL;
+    template->addr = addr;
+    template->guest_size = guest_size;
+    template->size = size;
+    template->mem_used = mem_used;
+    template->host_ptrs = &template->code[size];
+    template->gadgets = &template->host_ptrs[BITMAP_WORDS(size)];
+    template->guest = (byte_t *) &template->gadgets[BITMAP_WORDS(size)];
+    return template;
+}
+
+void jit_shared_insert(struct jit_template *template) {
+    lock(&jit_shared.lock, 0);
+    list_init_add(&jit_shared.hash[template->addr % JIT_SHARED_HASH_SIZE], &template->chain);
+    list_add_tail(&jit_shared.fifo, &template->fifo);
+    jit_shared.mem_used += template->mem_used;
+    while (jit_shared.mem_used > JIT_SHARED_CACHE_SIZE) {
+        struct jit_template *oldest = list_first_entry(&jit_shared.fifo, struct jit_template, fifo);
+        list_remove(&oldest->chain);
+        list_remove(&oldest->fifo);
+        jit_shared.mem_used -= oldest->mem_used;
+        free(oldest);
+    }
+    unlock(&jit_shared.lock);
+}
+
+static struct jit_block *jit_template_instantiate(struct jit *jit, struct jit_template *template) {
+    struct gen_state state = {
+        .jit = jit,
+        .ip = template->addr + template->guest_size,
+        .size = template->size,
+        .capacity = template->size + BITMAP_WORDS(template->size),
+        .block_patch_ip = template->block_patch_ip,
+        .gadgets = template->gadgets,
+    };
+    for (int i = 0; i <= 1; i++)
+        state.jump_ip[i] = template->jump_ip[i];
+    state.block = malloc(sizeof(struct jit_block) + state.capacity * sizeof(unsigned long));
+    state.block->addr = template->addr;
+    memcpy(state.block->code, template->code, template->size * sizeof(unsigned long));
+    gen_end(&state);
+    state.block->used = state.capacity;
+    return state.block;
+}
+
+// The guest code is read without the lock, since that can miss the tlb and
+// go through mem_ptr. Templates at the same address can cover different
+// amounts of code, so the lock is taken once to find out how much to read,
+// and again to compare. Anything that changes in between just means a miss.
+static struct jit_block *jit_shared_lookup(struct jit *jit, addr_t ip, struct tlb *tlb) {
+    struct list *bucket = &jit_shared.hash[ip % JIT_SHARED_HASH_SIZE];
+    struct jit_template *template;
+    unsigned size = 0;
+    lock(&jit_shared.lock, 0);
+    if (!list_null(bucket)) {
+        list_for_each_entry(bucket, template, chain) {
+            if (template->addr == ip && template->guest_size > size)
+                size = template->guest_size;
+        }
+    }
+    unlock(&jit_shared.lock);
+    if (size == 0)
+        return NULL;
+
+    // if the next page isn't there anymore, templates that stay in this one
+    // can still match
+    byte_t guest[PAGE_SIZE];
+    if (!tlb_read(tlb, ip, guest, size)) {
+        size = PAGE_SIZE - PGOFFSET(ip);
+        if (!tlb_read(tlb, ip, guest, size))
+            return NULL;
+    }
+
+    struct jit_block *block = NULL;
+    lock(&jit_shared.lock, 0);
+    if (!list_null(bucket)) {
+        list_for_each_entry(bucket, template, chain) {
+            if (template->addr != ip || template->guest_size > size ||
+                    memcmp(guest, template->guest, template->guest_size) != 0)
+                continue;
+            block = jit_template_instantiate(jit, template);
+            break;
+        }
+    }
+    unlock(&jit_shared.lock);
+    return block;
+}
+
+// Returns the mapping the block's code comes from, if the block can be shared.
+static struct data *jit_shareable_data(struct jit *jit, addr_t start, addr_t end) {
+    struct mem *mem = container_of(jit->mmu, struct mem, mmu);
+    struct data *data = NULL;
+    for (page_t page = PAGE(start); page <= PAGE(end - 1); page++) {
+        struct pt_entry *entry = mem_pt(mem, page);
+        if (entry == NULL || entry->flags & P_WRITE)
+            return NULL;
+        if (data == NULL)
+            data = entry->data;
+    }
+    return data;
+}
+
+static void jit_shared_publish(struct jit *jit, struct gen_state *state, addr_t ip, struct tlb *tlb) {
+    unsigned guest_size = state->ip - ip;
+    if (state->segfaulted || guest_size == 0)
+        return;
+    struct data *data = jit_shareable_data(jit, ip, state->ip);
+    if (data == NULL)
+        return;
+
+    struct jit_template *template = jit_template_new(ip, guest_size, state->size);
+    if (template == NULL)
+        return;
+    for (int i = 0; i <= 1; i++)
+        template->jump_ip[i] = state->jump_ip[i];
+    template->block_patch_ip = state->block_patch_ip;
+    memcpy(template->code, state->block->code, state->size * sizeof(unsigned long));
+    memcpy(template->host_ptrs, state->host_ptrs, BITMAP_WORDS(state->size) * sizeof(unsigned long));
+    memcpy(template->gadgets, state->gadgets, BITMAP_WORDS(state->size) * sizeof(unsigned long));
+    if (!tlb_read(tlb, ip, template->guest, guest_size)) {
+        free(template);
+        return;
+    }
+    // has to be done before other threads can see the template and evict it
+    jit_disk_save(data, template);
+    jit_shared_insert(template);
+}
+
+static struct jit_block *jit_block_compile(struct jit *jit, addr_t ip, struct tlb *tlb) {
+    struct jit_block *block = jit_shared_lookup(jit, ip, tlb);
+    if (block == NULL) {
+        // the first miss in a file gets everything we saved for it last time
+        struct data *data = jit_shareable_data(jit, ip, ip + 1);
+        if (data != NULL && jit_disk_load(data))
+            block = jit_shared_lookup(jit, ip, tlb);
+    }
+    if (block != NULL) {
+        TRACE("%d %08x --- copied from shared cache\n", current_pid(), ip);
+        jit_stat(shared_copies)++;
+        return block;
+    }
+
+    uint64_t start_ns = jit_time_ns();
     struct gen_state state;
     TRACE("%d %08x --- compiling:\n", current_pid(), ip);
     
-    gen_start(ip, &state);
+    gen_start(jit, ip, &state);
     while (true) {
         if (!gen_step(&state, tlb))
             break;
@@ -143,7 +698,7 @@ static struct jit_block *jit_block_compile(addr_t ip, struct tlb *tlb) {
         // guarantee that by stopping as soon as there's less space left than
         // the maximum length of an x86 instruction
         // TODO refuse to decode instructions longer than 15 bytes
-        if (state.ip - ip >= PAGE_SIZE - 15) {
+        if (state.ip - state.start >= PAGE_SIZE - 15) {
             gen_exit(&state);
             break;
         }
@@ -151,17 +706,369 @@ static struct jit_block *jit_block_compile(addr_t ip, struct tlb *tlb) {
     gen_end(&state);
     assert(state.ip - ip <= PAGE_SIZE);
     state.block->used = state.capacity;
+    jit_shared_publish(jit, &state, ip, tlb);
+    gen_free(&state);
+    jit_stat(compiled)++;
+    jit_stat(compile_ns) += jit_time_ns() - start_ns;
     return state.block;
 }
 
+static uint64_t jit_page_invalidations(struct jit *jit, page_t page) {
+    if (page >= MEM_PAGES)
+        return 0;
+    struct pt_entry *entry = jit_pt(jit, page);
+    if (entry == NULL)
+        return 0;
+    return __atomic_load_n(&entry->jit_invalidations, __ATOMIC_SEQ_CST);
+}
+
+static uint64_t jit_invalidations(struct jit *jit, page_t first, page_t second) {
+    uint64_t invalidations = __atomic_load_n(&jit->invalidations, __ATOMIC_SEQ_CST);
+    invalidations += jit_page_invalidations(jit, first);
+    if (second != first)
+        invalidations += jit_page_invalidations(jit, second);
+    return invalidations;
+}
+
+// Insert a block compiled from the code in pages first and second, unless
+// they were invalidated since the count was taken. Writes to pages with no
+// blocks don't take the lock (see jit_invalidate_page), so this checks again
+// after the block is in the page lists, where any later write will find it.
+// Must be called with jit->lock held.
+static bool jit_insert_fresh(struct jit *jit, struct jit_block *block, uint64_t invalidations, page_t first, page_t second) {
+    if (jit_invalidations(jit, first, second) != invalidations)
+        return false;
+    jit_insert(jit, block);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (jit_invalidations(jit, first, second) == invalidations)
+        return true;
+    jit_block_retire(jit, block);
+    jit_epoch_try_advance(jit);
+    return false;
+}
+
+// Compile a block after a lookup missed. This happens without the lock, so
+// several threads can compile at once. Whichever gets its block in first
+// wins, and the others use that one. If the block's pages were invalidated
+// while it was being compiled, it might have been made from the old code and
+// wouldn't be around to get invalidated, so it's compiled again.
+static struct jit_block *jit_block_get(struct jit *jit, addr_t ip, struct tlb *tlb) {
+    // a block can run into the next page
+    page_t first = PAGE(ip), second = PAGE(ip) + 1;
+    while (true) {
+        uint64_t invalidations = jit_invalidations(jit, first, second);
+        struct jit_block *block = jit_block_compile(jit, ip, tlb);
+        lock(&jit->lock, 0);
+        struct jit_block *other = jit_lookup(jit, ip);
+        bool inserted = other == NULL && jit_insert_fresh(jit, block, invalidations, first, second);
+        unlock(&jit->lock);
+        if (inserted) {
+            // this thread's own write entries can go right away
+            tlb_refresh(tlb, jit->mmu);
+            if (jit_perf_map)
+                jit_perf_map_block(jit, block);
+            return block;
+        }
+        if (other != NULL) {
+            jit_block_free(NULL, block);
+            return other;
+        }
+        // a stale block that made it into the lists was retired instead
+        if (!block->is_jetsam)
+            jit_block_free(NULL, block);
+    }
+}
+
+// Blocks waiting for a compile thread. Jobs only have a pointer to their
+// jit, so a compile thread takes a job and enters its jit's epoch in one go
+// with the lock held, and jit_free drops the jit's jobs with it held before
+// checking that the epoch counts have drained, see jit_compile_idle.
+static struct {
+    struct jit_compile_job {
+        struct jit *jit; // NULL if cancelled
+        addr_t ip;
+        bool speculative;
+    } jobs[JIT_COMPILE_QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+    unsigned threads; // started so far
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} jit_compile = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+// mem_ptr maps in the page below a stack when it's read, which a compile
+// thread has no business doing, so it only takes blocks that can't run into
+// an unmapped page. Must be called with the mem read locked.
+static bool jit_compile_mapped(struct jit *jit, addr_t ip) {
+    page_t page = PAGE(ip);
+    return jit_pt(jit, page) != NULL && (page + 1 >= MEM_PAGES || jit_pt(jit, page + 1) != NULL);
+}
+
+static void jit_compile_successors(struct jit *jit, struct jit_block *block);
+
+// Code that hasn't run yet might still be in the middle of being written,
+// and writes only invalidate a page once it has blocks (see jit_insert), so
+// speculating stays in pages that already do. Must be called with the mem
+// read locked.
+static bool jit_compile_speculable(struct jit *jit, addr_t ip) {
+    struct pt_entry *entry = jit_pt(jit, PAGE(ip));
+    return entry != NULL && jit_page_has_code(entry);
+}
+
+static void jit_compile_run(struct jit *jit, addr_t ip, bool speculative, struct tlb *tlb) {
+    struct mem *mem = container_of(jit->mmu, struct mem, mmu);
+    // the write lock is only held to change the memory map, and whoever has
+    // it might be freeing this jit and waiting for us, so don't wait for it
+    if (read_trylock(&mem->lock) != 0)
+        return;
+    struct jit_thread *thread = jit_thread_get();
+    if (thread->jit_id != jit->id)
+        jit_thread_set_jit(thread, jit->id);
+    // a new mem can turn up where a freed one was, so start from scratch
+    tlb->mmu = NULL;
+    tlb_refresh(tlb, jit->mmu);
+    struct jit_block *block = NULL;
+    if (jit_lookup(jit, ip) == NULL && jit_compile_mapped(jit, ip) &&
+            (!speculative || jit_compile_speculable(jit, ip)))
+        block = jit_block_get(jit, ip, tlb);
+    if (block != NULL && !speculative)
+        jit_compile_successors(jit, block);
+    read_unlock(&mem->lock, __FILE__, __LINE__);
+}
+
+static void *jit_compile_thread(void *UNUSED(arg)) {
+    struct tlb tlb = {};
+    pthread_mutex_lock(&jit_compile.lock);
+    while (true) {
+        while (jit_compile.count == 0) {
+            // quit when there's been nothing to do for a while, so the
+            // threads don't keep the process around after the last task
+            // exits
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += JIT_COMPILE_IDLE_SECS;
+            if (pthread_cond_timedwait(&jit_compile.cond, &jit_compile.lock, &deadline) == ETIMEDOUT &&
+                    jit_compile.count == 0) {
+                jit_compile.threads--;
+                pthread_mutex_unlock(&jit_compile.lock);
+                return NULL;
+            }
+        }
+        struct jit_compile_job job = jit_compile.jobs[jit_compile.head];
+        jit_compile.head = (jit_compile.head + 1) % JIT_COMPILE_QUEUE_SIZE;
+        jit_compile.count--;
+        if (job.jit == NULL)
+            continue;
+        uint64_t epoch = jit_epoch_enter(job.jit);
+        pthread_mutex_unlock(&jit_compile.lock);
+        jit_compile_run(job.jit, job.ip, job.speculative, &tlb);
+        jit_epoch_exit(job.jit, epoch);
+        pthread_mutex_lock(&jit_compile.lock);
+    }
+    return NULL;
+}
+
+// Must be called with jit_compile.lock held. The threads are only started
+// once something wants them, and again after they've quit for being idle.
+static void jit_compile_start(void) {
+    while (jit_compile.threads < JIT_COMPILE_THREADS) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, jit_compile_thread, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        jit_compile.threads++;
+    }
+}
+
+// Hand a block to the compile threads. Returns false if they can't take it,
+// in which case the caller has to compile it if it wants it. Speculative
+// jobs only get half the queue, so there's always room for ones that are
+// being waited on. Must be called with the mem read locked.
+static bool jit_compile_queue(struct jit *jit, addr_t ip, bool speculative) {
+    if (JIT_COMPILE_THREADS == 0 || !jit_compile_mapped(jit, ip))
+        return false;
+    bool queued = false;
+    pthread_mutex_lock(&jit_compile.lock);
+    if (jit_compile.threads < JIT_COMPILE_THREADS)
+        jit_compile_start();
+    if (jit_compile.threads == 0)
+        goto out;
+    for (unsigned i = 0; i < jit_compile.count; i++) {
+        struct jit_compile_job *job = &jit_compile.jobs[(jit_compile.head + i) % JIT_COMPILE_QUEUE_SIZE];
+        if (job->jit == jit && job->ip == ip) {
+            queued = true;
+            goto out;
+        }
+    }
+    if (jit_compile.count >= (speculative ? JIT_COMPILE_QUEUE_SIZE / 2 : JIT_COMPILE_QUEUE_SIZE))
+        goto out;
+    jit_compile.jobs[(jit_compile.head + jit_compile.count) % JIT_COMPILE_QUEUE_SIZE] =
+        (struct jit_compile_job) {.jit = jit, .ip = ip, .speculative = speculative};
+    jit_compile.count++;
+    pthread_cond_signal(&jit_compile.cond);
+    queued = true;
+out:
+    pthread_mutex_unlock(&jit_compile.lock);
+    return queued;
+}
+
+// The static targets of a block that was just wanted are likely to be
+// wanted next, so they get compiled ahead of time. That's only one level
+// deep, so new code doesn't turn into compiling everything reachable from it.
+// Indirect jumps and calls have an inline cache instead of a target. Must be
+// called with the mem read locked.
+static void jit_compile_successors(struct jit *jit, struct jit_block *block) {
+    for (int i = 0; i <= 1; i++) {
+        if (block->jump_ip[i] == NULL || block->old_jump_ip[i] == JIT_IC_EMPTY)
+            continue;
+        addr_t target = block->old_jump_ip[i] & 0xffffffff;
+        if (jit_lookup(jit, target) == NULL && jit_compile_speculable(jit, target) &&
+                jit_compile_queue(jit, target, true))
+            jit_stat(speculated)++;
+    }
+}
+
+// Drops the jit's jobs and says whether anything still has its epoch
+// entered. Compile threads only enter it with jit_compile.lock held, and any
+// jobs they queue while in it get dropped by the next call, so once this
+// returns true nothing can get back in.
+static bool jit_compile_idle(struct jit *jit) {
+    pthread_mutex_lock(&jit_compile.lock);
+    for (unsigned i = 0; i < jit_compile.count; i++) {
+        struct jit_compile_job *job = &jit_compile.jobs[(jit_compile.head + i) % JIT_COMPILE_QUEUE_SIZE];
+        if (job->jit == jit)
+            job->jit = NULL;
+    }
+    bool idle = __atomic_load_n(&jit->active[0], __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&jit->active[1], __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&jit->active[2], __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&jit_compile.lock);
+    return idle;
+}
+
+// Which way out of the block is the hot one, or -1 if it doesn't have one.
+// Jumps themselves aren't counted, so this goes by how often the blocks they
+// go to were entered. The other way has to be rare, since leaving a trace
+// costs a jump to another block. Must be called in an epoch.
+static int jit_trace_successor(struct jit *jit, struct jit_block *block) {
+    unsigned counts[2] = {0, 0};
+    for (int i = 0; i <= 1; i++) {
+        if (block->jump_ip[i] == NULL || block->old_jump_ip[i] == JIT_IC_EMPTY)
+            continue;
+        struct jit_block *target = jit_lookup(jit, block->old_jump_ip[i] & 0xffffffff);
+        if (target != NULL)
+            counts[i] = target->exec_count;
+    }
+    int hot = counts[1] > counts[0];
+    if (counts[hot] < JIT_HOT_THRESHOLD / 2 || counts[!hot] * 4 > counts[hot])
+        return -1;
+    return hot;
+}
+
+// A trace starts at the target of a hot backwards jump and follows the hot
+// successor of each block until it gets back there. Jumps to the next block
+// in the trace are compiled as side exits (see jcc in gen.c), so the whole
+// loop body runs as one block and the jump back to the start chains to
+// itself. The trace takes over the address of its first block, which gets
+// retired. All of its code has to be in at most two pages, so it can be
+// hooked into the page lists like any other block, which is what gets it
+// invalidated when any of the code it covers changes.
+//
+// Compiling happens without the lock, like in jit_block_get. If the head was
+// replaced or its code changed in the meantime, the trace is thrown away.
+// Must be called in an epoch, without jit->lock held.
+static struct jit_block *jit_trace_form(struct jit *jit, struct jit_block *head, struct tlb *tlb) {
+    if (head->is_trace || head->is_jetsam)
+        return NULL;
+    addr_t trace[JIT_TRACE_MAX_BLOCKS];
+    unsigned len = 0;
+    page_t pages[2] = {PAGE(head->addr), PAGE(head->addr)};
+    struct jit_block *block = head;
+    while (true) {
+        page_t block_pages[2] = {PAGE(block->addr), PAGE(block->end_addr)};
+        for (int i = 0; i <= 1; i++) {
+            if (block_pages[i] == pages[0] || block_pages[i] == pages[1])
+                continue;
+            if (pages[1] != pages[0])
+                return NULL;
+            pages[1] = block_pages[i];
+        }
+        trace[len++] = block->addr;
+        int next = jit_trace_successor(jit, block);
+        if (next < 0)
+            return NULL;
+        addr_t next_addr = block->old_jump_ip[next] & 0xffffffff;
+        if (next_addr == head->addr)
+            break;
+        if (len == JIT_TRACE_MAX_BLOCKS)
+            return NULL;
+        // inner loops get their own trace
+        for (unsigned i = 0; i < len; i++) {
+            if (trace[i] == next_addr)
+                return NULL;
+        }
+        block = jit_lookup(jit, next_addr);
+        if (block == NULL || block->is_trace)
+            return NULL;
+    }
+    if (len < 2)
+        return NULL;
+
+    uint64_t invalidations = jit_invalidations(jit, pages[0], pages[1]);
+    uint64_t start_ns = jit_time_ns();
+    struct gen_state state;
+    TRACE("%d %08x --- compiling trace of %u blocks:\n", current_pid(), head->addr, len);
+    gen_start(jit, head->addr, &state);
+    state.trace = trace;
+    state.trace_len = len;
+    while (gen_step(&state, tlb)) {
+        if (state.ip - state.start >= PAGE_SIZE - 15) {
+            gen_exit(&state);
+            break;
+        }
+    }
+    gen_end(&state);
+    gen_free(&state);
+    jit_stat(compile_ns) += jit_time_ns() - start_ns;
+    block = state.block;
+    // the code changed since the blocks were compiled, or they didn't end the
+    // way the counts said
+    if (state.segfaulted || state.trace_pos != len - 1) {
+        jit_block_free(NULL, block);
+        return NULL;
+    }
+    block->used = state.capacity;
+    block->is_trace = true;
+    block->end_addr = pages[1] != pages[0] ? pages[1] << PAGE_BITS : block->addr;
+
+    lock(&jit->lock, 0);
+    bool inserted = false;
+    if (jit_lookup(jit, head->addr) == head) {
+        jit_block_retire(jit, head);
+        jit_epoch_try_advance(jit);
+        inserted = jit_insert_fresh(jit, block, invalidations, pages[0], pages[1]);
+    }
+    unlock(&jit->lock);
+    if (!inserted) {
+        if (!block->is_jetsam)
+            jit_block_free(NULL, block);
+        return NULL;
+    }
+    jit_stat(traces)++;
+    if (jit_perf_map)
+        jit_perf_map_block(jit, block);
+    return block;
+}
+
 // Remove all pointers to the block. It can't be freed yet because another
 // thread may be executing it.
 static void jit_block_disconnect(struct jit *jit, struct jit_block *block) {
     if (jit != NULL) {
-        jit->mem_used -= block->used;
+        jit->mem_used -= jit_block_size(block);
+        __atomic_sub_fetch(&jit_global_mem_used, jit_block_size(block), __ATOMIC_RELAXED);
         jit->num_blocks--;
+        jit_table_remove(jit, block);
     }
-    list_remove(&block->chain);
     for (int i = 0; i <= 1; i++) {
         ////modify_critical_region_counter(current, 1, __FILE__, __LINE__);
         list_remove(&block->page[i]);
@@ -179,16 +1086,24 @@ static void jit_block_disconnect(struct jit *jit, struct jit_block *block) {
         
         ////modify_critical_region_counter(current, -1, __FILE__, __LINE__);
     }
+    for (unsigned i = 0; i < block->side_exits_count; i++)
+        list_remove_safe(&block->side_exits[i].link);
+    struct jit_side_exit *side, *tmp_side;
+    list_for_each_entry_safe(&block->side_jumps_from, side, tmp_side, link) {
+        *side->ip = side->old_ip;
+        list_remove(&side->link);
+    }
 }
 
 static void jit_block_free(struct jit *jit, struct jit_block *block) {
    // critical_region_count_increase(current);
     jit_block_disconnect(jit, block);
-    free(block);
+    jit_arena_free(block);
     //critical_region_count_decrease(current);
 }
 
-static void jit_free_jetsam(struct jit *jit) {
+// Free jetsam blocks retired before the given epoch.
+static void jit_free_jetsam(struct jit *jit, uint64_t before) {
    /* if(!strcmp(current->comm, "go")) {
         // Sleep for a bit if this is go.  Kludge alert.  -mke
         struct timespec wait;
@@ -198,8 +1113,18 @@ static void jit_free_jetsam(struct jit *jit) {
     } */
     struct jit_block *block, *tmp;
     list_for_each_entry_safe(&jit->jetsam, block, tmp, jetsam) {
+        if (block->jetsam_epoch >= before)
+            continue;
         list_remove(&block->jetsam);
-        free(block);
+        jit_arena_free(block);
+        jit_stat(jetsam_freed)++;
+    }
+    struct jit_table *table, *tmp_table;
+    list_for_each_entry_safe(&jit->old_tables, table, tmp_table, old) {
+        if (table->retired_epoch >= before)
+            continue;
+        list_remove(&table->old);
+        free(table);
     }
 }
 
@@ -209,67 +1134,169 @@ static inline size_t jit_cache_hash(addr_t ip) {
     return (ip ^ (ip >> 12)) % JIT_CACHE_SIZE;
 }
 
+// Whether to interpret a block that isn't in the table. Once it's warm
+// enough to compile, it's queued for the compile threads, and interpreted
+// until it shows up. If it doesn't show up soon enough, or couldn't be
+// queued, it gets compiled here. Counts without the lock, so two threads can
+// lose an increment, which doesn't matter.
+static bool jit_interp_cold(struct jit *jit, addr_t ip) {
+    uint8_t *count = &jit->interp_counts[(ip ^ (ip >> 12)) % JIT_INTERP_COUNTS];
+    uint8_t n = __atomic_load_n(count, __ATOMIC_RELAXED);
+    if (n >= JIT_INTERP_THRESHOLD + JIT_COMPILE_PATIENCE)
+        return false;
+    if (n == JIT_INTERP_THRESHOLD) {
+        if (!jit_compile_queue(jit, ip, false))
+            return false;
+        jit_stat(queued)++;
+    }
+    __atomic_store_n(count, n + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
 static int cpu_step_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
     struct jit *jit = cpu->mmu->jit;
-    read_lock(&jit->jetsam_lock, __FILE__, __LINE__);
 
-    struct jit_block **cache = calloc(JIT_CACHE_SIZE, sizeof(*cache));
-    struct jit_frame *frame = malloc(sizeof(struct jit_frame));
-    memset(frame, 0, sizeof(*frame));
+    // Nothing retired since the epoch we announce can be freed until we leave
+    // it. Cached pointers are only good if they were picked up in this same
+    // epoch, since anything older might have been retired and freed already.
+    struct jit_thread *thread = jit_thread_get();
+    uint64_t epoch = jit_epoch_enter(jit);
+    if (thread->jit_id != jit->id || thread->epoch != epoch || thread->mem_changes != jit->mmu->changes) {
+        jit_thread_flush(thread);
+        if (thread->jit_id != jit->id)
+            jit_thread_set_jit(thread, jit->id);
+        thread->mem_changes = jit->mmu->changes;
+    }
+    struct jit_block **cache = thread->cache;
+    struct jit_frame *frame = &thread->frame;
     frame->cpu = *cpu;
+    frame->last_block = NULL;
+    frame->ic_miss = NULL;
     assert(jit->mmu == cpu->mmu);
 
     int interrupt = INT_NONE;
     while (interrupt == INT_NONE) {
+        // quiescent point: let the epoch move on if it wants to
+        if (__atomic_load_n(&jit->epoch, __ATOMIC_RELAXED) != epoch) {
+            uint64_t new_epoch = jit_epoch_enter(jit);
+            jit_epoch_exit(jit, epoch);
+            epoch = new_epoch;
+            jit_thread_flush(thread);
+        }
+
         addr_t ip = frame->cpu.eip;
         size_t cache_index = jit_cache_hash(ip);
         struct jit_block *block = cache[cache_index];
         //////modify_critical_region_counter(current, 1, __FILE__, __LINE__);
-        if (block == NULL || block->addr != ip) {
-            lock(&jit->lock, 0);
+        if (block == NULL || block->addr != ip || block->is_jetsam) {
             block = jit_lookup(jit, ip);
+            if (block == NULL)
+                thread->stats.lookup_misses++;
+            else
+                thread->stats.cache_misses++;
+            if (block == NULL && jit_interp_cold(jit, ip)) {
+                // nothing to chain from or to
+                thread->stats.interpreted++;
+                interrupt = cpu_interp_block(&frame->cpu, tlb);
+                frame->last_block = NULL;
+                frame->ic_miss = NULL;
+                goto interpreted;
+            }
             if (block == NULL) {
-                block = jit_block_compile(ip, tlb);
-                jit_insert(jit, block);
-            } else {
+                block = jit_block_get(jit, ip, tlb);
+                jit_compile_successors(jit, block);
+            } else
                 TRACE("%d %08x --- missed cache\n", current_pid(), ip);
-            }
             cache[cache_index] = block;
-            unlock(&jit->lock);
+        } else {
+            thread->stats.cache_hits++;
         }
+        if (!block->referenced)
+            block->referenced = true;
         //////modify_critical_region_counter(current, -1, __FILE__, __LINE__);
+        // Chained jumps skip this loop, so they count entries themselves and
+        // come back here for the one that makes the block hot
+        bool hot = false;
+        if (block->exec_count < JIT_EXEC_COUNT_MAX)
+            hot = ++block->exec_count == JIT_HOT_THRESHOLD;
+
         struct jit_block *last_block = frame->last_block;
+        if (hot && last_block != NULL && block->addr <= last_block->addr) {
+            for (int i = 0; i <= 1; i++) {
+                if (last_block->jump_ip[i] == NULL ||
+                        (last_block->old_jump_ip[i] & 0xffffffff) != block->addr)
+                    continue;
+                struct jit_block *trace = jit_trace_form(jit, block, tlb);
+                if (trace != NULL) {
+                    block = trace;
+                    cache[cache_index] = block;
+                }
+                break;
+            }
+        }
+        if (hot && jit_native_available())
+            jit_native_promote(block);
+
         if (last_block != NULL &&
                 (last_block->jump_ip[0] != NULL ||
-                 last_block->jump_ip[1] != NULL)) {
+                 last_block->jump_ip[1] != NULL ||
+                 last_block->side_exits_count != 0)) {
             lock(&jit->lock, 0);
             // can't mint new pointers to a block that has been marked jetsam
             // and is thus assumed to have no pointers left
             if (!last_block->is_jetsam && !block->is_jetsam) {
                 for (int i = 0; i <= 1; i++) {
                     if (last_block->jump_ip[i] != NULL &&
+                            last_block->old_jump_ip[i] != JIT_IC_EMPTY &&
                             (*last_block->jump_ip[i] & 0xffffffff) == block->addr) {
                         *last_block->jump_ip[i] = (unsigned long) block->code;
+                        thread->stats.chained++;
 			//modify_critical_region_counter(current, 1, __FILE__, __LINE__);
                         list_add(&block->jumps_from[i], &last_block->jumps_from_links[i]);
 			//modify_critical_region_counter(current, -1, __FILE__, __LINE__);
                     }
                 }
+                for (unsigned i = 0; i < last_block->side_exits_count; i++) {
+                    struct jit_side_exit *side = &last_block->side_exits[i];
+                    if (*side->ip == side->old_ip && (side->old_ip & 0xffffffff) == block->addr) {
+                        *side->ip = (unsigned long) block->code;
+                        thread->stats.chained++;
+                        list_add(&block->side_jumps_from, &side->link);
+                    }
+                }
             }
 
             unlock(&jit->lock);
         }
         
+        // An indirect jump or call in last_block came here and missed its
+        // inline cache. Only the first target gets cached, so a site that
+        // goes lots of places doesn't keep taking the lock.
+        unsigned long *ic = frame->ic_miss;
+        frame->ic_miss = NULL;
+        if (ic != NULL && last_block != NULL && last_block->jump_ip[1] == ic &&
+                __atomic_load_n(ic, __ATOMIC_RELAXED) == JIT_IC_EMPTY) {
+            lock(&jit->lock, 0);
+            if (!last_block->is_jetsam && !block->is_jetsam && *ic == JIT_IC_EMPTY) {
+                __atomic_store_n(ic, (unsigned long) block->code, __ATOMIC_RELEASE);
+                thread->stats.ic_fills++;
+                list_add(&block->jumps_from[1], &last_block->jumps_from_links[1]);
+            }
+            unlock(&jit->lock);
+        }
+
         //////modify_critical_region_counter(current, -1, __FILE__, __LINE__);
         
         frame->last_block = block;
 
         // block may be jetsam, but that's ok, because it can't be freed until
-        // every thread on this jit is not executing anything
+        // we've moved on from this epoch
 
         TRACE("%d %08x --- cycle %ld\n", current_pid(), ip, frame->cpu.cycle);
 
         interrupt = jit_enter(block, frame, tlb);
+    interpreted:
+        thread->stats.exits[(uint8_t) interrupt]++;
         if (interrupt == INT_NONE && __atomic_exchange_n(cpu->poked_ptr, false, __ATOMIC_SEQ_CST))
             interrupt = INT_TIMER;
         if (interrupt == INT_NONE && ++frame->cpu.cycle % (1 << 10) == 0)
@@ -277,19 +1304,20 @@ static int cpu_step_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
         *cpu = frame->cpu;
     }
 
-    free(frame);
-    free(cache);
-    read_unlock(&jit->jetsam_lock, __FILE__, __LINE__);
+    thread->epoch = epoch;
+    jit_epoch_exit(jit, epoch);
     return interrupt;
 
 }
 
 static int cpu_single_step(struct cpu_state *cpu, struct tlb *tlb) {
     struct gen_state state;
-    gen_start(cpu->eip, &state);
+    gen_start(NULL, cpu->eip, &state);
+    state.precise_flags = true;
     gen_step(&state, tlb);
     gen_exit(&state);
     gen_end(&state);
+    gen_free(&state);
 
     struct jit_block *block = state.block;
     struct jit_frame frame = {.cpu = *cpu};
@@ -311,20 +1339,11 @@ int cpu_run_to_interrupt(struct cpu_state *cpu, struct tlb *tlb) {
 
     struct jit *jit = cpu->mmu->jit;
     lock(&jit->lock, 0);
-    if (!list_empty(&jit->jetsam)) {
-        // write-lock the jetsam_lock to wait until other jit threads get to
-        // this point, so they will all clear out their block pointers
-        // TODO: use RCU for better performance
-        unlock(&jit->lock);
-        write_lock(&jit->jetsam_lock);
-        lock(&jit->lock, 0);
-        while(critical_region_count(current) > 3) {// Yes, this is weird.  It might not work, but I'm trying.  -mke
-            nanosleep(&lock_pause, NULL);          // Yes, this has triggered at least once.  Is it doing any good though? -mke
-        }
-        jit_free_jetsam(jit);
-        write_unlock(&jit->jetsam_lock, __FILE__, __LINE__);
-        unlock(&jit->lock);
-        return interrupt;
+    if (!list_empty(&jit->jetsam) || !list_empty(&jit->old_tables)) {
+        // we're out of the jit now, so we might be what's holding back the
+        // epoch. anything retired two epochs ago is unreachable by everyone.
+        jit_epoch_try_advance(jit);
+        jit_free_jetsam(jit, jit->epoch - 1);
     }
     unlock(&jit->lock);
     //////modify_critical_region_counter(current, -1);
@@ -9,34 +9,95 @@
 
 #define JIT_INITIAL_HASH_SIZE (1 << 10)
 #define JIT_CACHE_SIZE (1 << 10)
-#define JIT_PAGE_HASH_SIZE (1 << 10)
+// translations shared between address spaces, see jit_shared_lookup
+#define JIT_SHARED_HASH_SIZE (1 << 12)
+#define JIT_SHARED_CACHE_SIZE (16 << 20)
+// Code is interpreted until its address has been run this many times, so
+// code that only runs once or twice never pays for being compiled. The
+// counts are hashed and may be shared between addresses, which only means
+// something gets compiled a little early.
+#ifndef JIT_INTERP_THRESHOLD
+#define JIT_INTERP_THRESHOLD 4
+#endif
+#define JIT_INTERP_COUNTS (1 << 12)
+// Blocks are compiled by a few threads of their own, see jit_compile_queue.
+// The thread that wants a block keeps interpreting it in the meantime, up to
+// JIT_COMPILE_PATIENCE more times before compiling it itself. With 0 threads
+// it's compiled right away by the thread that wants it.
+#ifndef JIT_COMPILE_THREADS
+#define JIT_COMPILE_THREADS 2
+#endif
+#define JIT_COMPILE_QUEUE_SIZE 256
+#define JIT_COMPILE_PATIENCE 64
+// compile threads with nothing to do for this long quit until they're needed
+#define JIT_COMPILE_IDLE_SECS 1
+
+// for the bitmaps describing the words in a block's code
+#define BITMAP_WORDS(size) (((size) + 63) / 64)
+#define BITMAP_TEST(bitmap, i) ((bitmap)[(i) / 64] & (1ul << ((i) % 64)))
 
 struct jit {
     // there is one jit per address space
     struct mmu *mmu;
-    size_t mem_used;
+    size_t mem_used; // in bytes
     size_t num_blocks;
+    // blocks evicted to stay under jit_mem_limit, and the table slot the
+    // clock hand is at, see jit_evict
+    uint64_t evictions;
+    size_t clock_hand;
 
-    struct list *hash;
-    size_t hash_size;
+    // open addressing table of blocks by address, read without the lock
+    struct jit_table *table;
+    size_t table_tombstones;
+    // tables that were replaced by a rebuild, freed like jetsam
+    struct list old_tables;
 
-    // list of jit_blocks that should be freed soon (at the next RCU grace
-    // period, if we had such a thing)
+    // arenas that blocks are allocated from, and the one being filled, see
+    // jit_arena_alloc
+    struct list arenas;
+    struct jit_arena *arena;
+    lock_t arena_lock;
+
+    // list of jit_blocks that should be freed once every thread has passed
+    // through two epochs since they were retired
     struct list jetsam;
+    // Never changes and is never reused, even by a jit at the same address
+    // after this one is freed. A thread's dispatch cache and stats record
+    // the id of the jit they're for, see struct jit_thread. Blocks being
+    // freed is tracked by the epoch instead.
+    uint64_t id;
+
+    // Epoch-based reclamation. A thread running code from this jit counts
+    // itself in active[e % 3] for the epoch e it announced, and re-announces
+    // at block dispatch boundaries. The epoch can only advance once nobody is
+    // left in the previous one, so threads are always in epoch or epoch - 1.
+    uint64_t epoch;
+    int active[3];
 
-    // A way to look up blocks in a page
-    struct {
-        struct list blocks[2];
-    } *page_hash;
+    // Blocks in a page are found through the blocks lists in its pt_entry.
+    // Invalidations too big to go page by page bump this instead of the
+    // pages' counters.
+    uint64_t invalidations;
+
+    // times each hashed block address has been interpreted, see
+    // JIT_INTERP_THRESHOLD
+    uint8_t interp_counts[JIT_INTERP_COUNTS];
 
     lock_t lock;
-    wrlock_t jetsam_lock;
 };
 
 // this is roughly the average number of instructions in a basic block according to anonymous sources
 // times 4, roughly the average number of gadgets/parameters in an instruction, according to anonymous sources
 #define JIT_BLOCK_INITIAL_CAPACITY 16
 
+// A jump out of the middle of a trace, see jcc in gen.c
+struct jit_side_exit {
+    unsigned long *ip;
+    unsigned long old_ip;
+    // in the side_jumps_from of the block it's chained to
+    struct list link;
+};
+
 struct jit_block {
     addr_t addr;
     addr_t end_addr;
@@ -49,8 +110,6 @@ struct jit_block {
     // blocks that jump to this block
     struct list jumps_from[2];
 
-    // hashtable bucket links
-    struct list chain;
     // list of blocks in a page
     struct list page[2];
     // links for jumps_from
@@ -58,15 +117,144 @@ struct jit_block {
     // links for free list
     struct list jetsam;
     bool is_jetsam;
+    // epoch when the block was put on jetsam
+    uint64_t jetsam_epoch;
+
+    // where the block's memory came from, NULL if it was malloced
+    struct jit_arena *arena;
+
+    // bitmap of which words in code are gadgets, points past the end of code
+    unsigned long *gadgets;
+    // times the block was entered, through the dispatcher or a chained jump,
+    // saturates at JIT_EXEC_COUNT_MAX
+    unsigned exec_count;
+    bool native;
+    // a superblock, see jit_trace_form
+    bool is_trace;
+    // a trace's side exits, stored past the end of gadgets, which get chained
+    // like jump_ip
+    struct jit_side_exit *side_exits;
+    unsigned side_exits_count;
+    // side exits that are chained to this block
+    struct list side_jumps_from;
+    // set on dispatch, cleared as the clock hand passes, see jit_evict
+    bool referenced;
 
     unsigned long code[];
 };
 
+// A translated block in a form that isn't tied to any jit, see
+// jit_shared_lookup in jit.c
+struct jit_template {
+    addr_t addr;
+    unsigned guest_size;
+    unsigned size; // of code, in longs
+    unsigned jump_ip[2];
+    unsigned block_patch_ip;
+    size_t mem_used;
+    struct list chain;
+    struct list fifo;
+    // bitmaps like in gen_state, stored past the end of code
+    unsigned long *host_ptrs;
+    unsigned long *gadgets;
+    byte_t *guest; // the guest code bytes, stored past the end of gadgets
+    unsigned long code[];
+};
+
+// Allocate a template with room for the given amount of code and guest bytes
+struct jit_template *jit_template_new(addr_t addr, unsigned guest_size, unsigned size);
+// Make a template available to every address space. Takes ownership.
+void jit_shared_insert(struct jit_template *template);
+
+// On-disk cache of templates for code mapped from files, see disk.c. Both are
+// no-ops unless jit_cache_dir is set.
+struct data;
+extern const char *jit_cache_dir;
+// Load the templates saved for the mapping's file, the first time it's seen.
+// Returns true if anything was loaded.
+bool jit_disk_load(struct data *data);
+void jit_disk_save(struct data *data, struct jit_template *template);
+
+// Entries in /tmp/perf-<pid>.map for host profilers, see perfmap.c. Only
+// written if jit_perf_map is set.
+extern bool jit_perf_map;
+void jit_perf_map_block(struct jit *jit, struct jit_block *block);
+void jit_perf_map_native(const void *code, size_t size);
+
+// A block is hot once it's been entered JIT_HOT_THRESHOLD times. Chained
+// jumps count entries too (see jit_ret_chain), and the one that makes a block
+// hot goes through the dispatcher instead, so it gets noticed. Counting goes
+// on up to JIT_EXEC_COUNT_MAX so traces can tell which way is the hot one.
+#define JIT_HOT_THRESHOLD 32
+#define JIT_EXEC_COUNT_MAX 1024
+
+// Native code tier for hot blocks, see native.c
+void jit_native_promote(struct jit_block *block);
+bool jit_native_available(void);
+
+// Superblocks. When a backwards jump makes its target hot, the hot path from
+// there around the loop is compiled again as one block of up to
+// JIT_TRACE_MAX_BLOCKS blocks.
+#define JIT_TRACE_MAX_BLOCKS 8
+
+// Limits on the memory used by blocks, in bytes, for each address space and
+// for all of them together. 0 means no limit. Going over either makes the
+// jit that's inserting a block evict its own cold blocks.
+extern size_t jit_mem_limit;
+extern size_t jit_global_mem_limit;
+extern size_t jit_global_mem_used;
+extern uint64_t jit_global_evictions;
+
+// Event counters, shown in /proc/ish/jit. Each thread counts into its own
+// copy with plain increments, and reading adds them all up. Counts belong to
+// the jit the thread last ran code from, and move to the global totals when
+// the thread goes to another jit or exits.
+struct jit_stats {
+    uint64_t cache_hits; // found in the thread's dispatch cache
+    uint64_t cache_misses; // found in the block table instead
+    uint64_t lookup_misses; // not in the table either
+    uint64_t interpreted; // blocks run without compiling, see JIT_INTERP_THRESHOLD
+    uint64_t compiled; // blocks generated, not counting shared_copies
+    uint64_t shared_copies; // blocks copied from the shared cache
+    uint64_t traces;
+    uint64_t compile_ns; // spent generating blocks and traces
+    uint64_t queued; // blocks handed to the compile threads
+    uint64_t speculated; // successors of new blocks queued ahead of time
+    uint64_t chained; // jumps patched to go straight to their target
+    uint64_t ic_fills; // inline caches filled
+    // blocks invalidated because their code was written to or unmapped
+    uint64_t invalidated_write;
+    uint64_t invalidated_unmap;
+    uint64_t jetsam_freed;
+    // what blocks returned to the dispatcher with, INT_NONE is 0xff
+    uint64_t exits[256];
+};
+// Sum of the counters of the threads on jit, or of every thread there has
+// been if jit is NULL.
+void jit_stats_collect(struct jit *jit, struct jit_stats *stats);
+// number of slots in jit's block table
+size_t jit_hash_size(struct jit *jit);
+
+// Blocks are allocated from per-jit arenas, so the code of a process is
+// packed together and the jit can be freed all at once. Without a jit, it's
+// a plain malloc. Dies when out of memory.
+#define JIT_ARENA_SIZE (256 << 10)
+struct jit_block *jit_arena_alloc(struct jit *jit, size_t size);
+void jit_arena_free(struct jit_block *block);
+
+// Inline caches. Indirect jumps and calls have a slot for the code of the
+// block they went to last time, which they use if the target address
+// matches the block's. It's jump_ip[1] of the block, with this as its
+// original value, so it gets filled in by the dispatcher on a miss and
+// emptied by jit_block_disconnect like any other chained jump.
+#define JIT_IC_EMPTY (3ul << 62)
+
 // Create a new jit
 struct jit *jit_new(struct mmu *mmu);
 void jit_free(struct jit *jit);
 
 // Invalidate all jit blocks in pages start (inclusive) to end (exclusive).
+// Costs the number of blocks or of pages in the range, whichever is less.
 // Locks the jit. Should only be called by memory.c in conjunction with
 // mem_changed.
 void jit_invalidate_range(struct jit *jit, page_t start, page_t end);
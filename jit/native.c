@@ -0,0 +1,198 @@
+#define DEFAULT_CHANNEL instr
+#include <string.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "jit/jit.h"
+
+extern int current_pid(void);
+
+// Second tier for hot blocks. Threaded code pays for an indirect jump at the
+// end of every gadget (gret). For runs of gadgets that are straight-line code,
+// this copies the gadget bodies back to back into executable memory, keeping
+// the add to _ip from each gret so the arguments are still read from the
+// block, and dropping the jumps in between. The first gadget pointer of the
+// run in the block is then swapped for the copy, and everything after it is
+// left alone, so skips into the middle of a run and blocks on other threads
+// keep working.
+//
+// Gadgets are copied up to the jmp of their first gret, using what the
+// .gadget macro puts right before each one (see gadgets-x86_64/gadgets.h).
+// Gadgets that exit, skip, or call out can't be moved and stay threaded. The
+// TLB miss and crosspage branches of memory gadgets are rel32, so the copy
+// gets them pointed back at the original's out of line code. That returns
+// into the original gadget, whose gret carries on threaded from the gadget
+// pointers left in the block. Copies only depend on which gadgets are in the
+// run, so identical runs share code, which bounds how much of the arena gets
+// used.
+//
+// Only on x86_64, and only where the host lets us map executable memory.
+
+#if defined(__x86_64__)
+
+#define NATIVE_ARENA_SIZE (16 << 20)
+#define NATIVE_RUN_HASH_SIZE (1 << 12)
+
+static struct {
+    lock_t lock;
+    bool broken;
+    byte_t *arena;
+    size_t arena_used;
+    struct list runs[NATIVE_RUN_HASH_SIZE];
+} native;
+
+struct native_run {
+    struct list chain;
+    void *code;
+    unsigned count;
+    unsigned long gadgets[];
+};
+
+// sync with .gadget in gadgets-x86_64/gadgets.h
+struct native_header {
+    // offsets of the ends of rel32 branches, or 0
+    uint16_t relocs[4];
+    // length of the jmp after body_size, 0 if the gadget can't be copied
+    uint16_t jmp_size;
+    uint16_t pad;
+    uint32_t body_size;
+};
+
+__attribute__((constructor)) static void native_init() {
+    lock_init(&native.lock, "jit_native\0");
+}
+
+static const struct native_header *native_header(unsigned long gadget) {
+    return (const struct native_header *) gadget - 1;
+}
+
+static unsigned long native_reloc_target(unsigned long gadget, unsigned reloc) {
+    int32_t rel;
+    memcpy(&rel, (const void *) (gadget + reloc - 4), sizeof(rel));
+    return gadget + reloc + rel;
+}
+
+// Returns how many bytes of the gadget to copy, or -1 if it can't be.
+static int native_gadget_body_size(unsigned long gadget) {
+    const struct native_header *header = native_header(gadget);
+    // jmp *-8(%r9)
+    if (header->jmp_size != 4 || header->body_size == 0)
+        return -1;
+    for (int i = 0; i < 4 && header->relocs[i] != 0; i++) {
+        // the copy has to be able to reach the same place
+        long from_start = native_reloc_target(gadget, header->relocs[i]) - (unsigned long) native.arena;
+        if (from_start > INT32_MAX || from_start - NATIVE_ARENA_SIZE < INT32_MIN)
+            return -1;
+    }
+    return header->body_size;
+}
+
+static void *native_emit_run(const unsigned long *gadgets, unsigned count) {
+    unsigned hash = 0;
+    for (unsigned i = 0; i < count; i++)
+        hash = hash * 31 + (unsigned) (gadgets[i] >> 2);
+    struct list *bucket = &native.runs[hash % NATIVE_RUN_HASH_SIZE];
+    if (!list_null(bucket)) {
+        struct native_run *run;
+        list_for_each_entry(bucket, run, chain) {
+            if (run->count == count && memcmp(run->gadgets, gadgets, count * sizeof(*gadgets)) == 0)
+                return run->code;
+        }
+    }
+
+    size_t size = 4;
+    for (unsigned i = 0; i < count; i++)
+        size += native_gadget_body_size(gadgets[i]);
+    if (native.arena_used + size > NATIVE_ARENA_SIZE)
+        return NULL;
+    struct native_run *run = malloc(sizeof(struct native_run) + count * sizeof(*gadgets));
+    if (run == NULL)
+        return NULL;
+    byte_t *code = native.arena + native.arena_used;
+    byte_t *p = code;
+    for (unsigned i = 0; i < count; i++) {
+        const struct native_header *header = native_header(gadgets[i]);
+        memcpy(p, (const void *) gadgets[i], header->body_size);
+        for (int j = 0; j < 4 && header->relocs[j] != 0; j++) {
+            unsigned reloc = header->relocs[j];
+            int32_t rel = native_reloc_target(gadgets[i], reloc) - (unsigned long) (p + reloc);
+            memcpy(p + reloc - 4, &rel, sizeof(rel));
+        }
+        p += header->body_size;
+    }
+    // the last gadget's jmp *-8(%r9)
+    memcpy(p, "\x41\xff\x61\xf8", 4);
+    native.arena_used += (size + 15) & ~15;
+
+    run->code = code;
+    run->count = count;
+    memcpy(run->gadgets, gadgets, count * sizeof(*gadgets));
+    list_init_add(bucket, &run->chain);
+    if (jit_perf_map)
+        jit_perf_map_native(code, size);
+    return code;
+}
+
+static void native_promote_run(struct jit_block *block, unsigned start, const unsigned long *gadgets, unsigned count) {
+    if (count < 2)
+        return;
+    void *code = native_emit_run(gadgets, count);
+    if (code != NULL)
+        __atomic_store_n(&block->code[start], (unsigned long) code, __ATOMIC_RELEASE);
+}
+
+void jit_native_promote(struct jit_block *block) {
+    lock(&native.lock, 0);
+    if (block->native || native.broken)
+        goto out;
+    block->native = true;
+    if (native.arena == NULL) {
+        // close to the gadgets, so rel32 branches out of copies reach
+        extern void gadget_exit(void);
+        unsigned long near = (unsigned long) gadget_exit & ~0xffffful;
+        near = near > (256 << 20) ? near - (256 << 20) : 0;
+        native.arena = mmap((void *) near, NATIVE_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (native.arena == MAP_FAILED) {
+            native.arena = NULL;
+            native.broken = true;
+            goto out;
+        }
+    }
+
+    unsigned long run[64];
+    unsigned run_start = 0;
+    unsigned run_count = 0;
+    unsigned size = block->gadgets - block->code;
+    for (unsigned i = 0; i < size; i++) {
+        if (!BITMAP_TEST(block->gadgets, i))
+            continue;
+        unsigned long gadget = block->code[i];
+        if (native_gadget_body_size(gadget) < 0 || run_count == sizeof(run) / sizeof(run[0])) {
+            native_promote_run(block, run_start, run, run_count);
+            run_count = 0;
+            if (native_gadget_body_size(gadget) < 0)
+                continue;
+        }
+        if (run_count == 0)
+            run_start = i;
+        run[run_count++] = gadget;
+    }
+    native_promote_run(block, run_start, run, run_count);
+    TRACE("%d %08x --- promoted to native\n", current_pid(), block->addr);
+out:
+    unlock(&native.lock);
+}
+
+bool jit_native_available() {
+    return !native.broken;
+}
+
+#else
+
+void jit_native_promote(struct jit_block *block) {}
+
+bool jit_native_available() {
+    return false;
+}
+
+#endif
@@ -48,7 +48,10 @@ void cpu() {
     OFFSET(LOCAL, jit_frame, value);
     OFFSET(LOCAL, jit_frame, value_addr);
     OFFSET(LOCAL, jit_frame, last_block);
-    OFFSET(LOCAL, jit_frame, ret_cache);
+    OFFSET(LOCAL, jit_frame, ic_miss);
+    OFFSET(LOCAL, jit_frame, ret_stack);
+    OFFSET(LOCAL, jit_frame, ret_top);
+    MACRO(JIT_RETURN_STACK_SIZE);
     OFFSET(CPU, cpu_state, segfault_addr);
     OFFSET(CPU, cpu_state, segfault_was_write);
     OFFSET(CPU, cpu_state, poked_ptr);
@@ -57,6 +60,9 @@ void cpu() {
 
     OFFSET(JIT_BLOCK, jit_block, addr);
     OFFSET(JIT_BLOCK, jit_block, code);
+    OFFSET(JIT_BLOCK, jit_block, exec_count);
+    MACRO(JIT_HOT_THRESHOLD);
+    MACRO(JIT_EXEC_COUNT_MAX);
 
     OFFSET(TLB, tlb, entries);
     OFFSET(TLB, tlb, dirty_page);
@@ -0,0 +1,254 @@
+#define DEFAULT_CHANNEL instr
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "debug.h"
+#include "jit/jit.h"
+#include "emu/memory.h"
+#include "kernel/elf.h"
+#include "kernel/fs.h"
+#include "fs/fd.h"
+
+extern int current_pid(void);
+
+// Entries for host profilers in /tmp/perf-<pid>.map, the format perf and most
+// other profilers read. Blocks are threaded code, so samples of the program
+// counter land in gadgets, and what points into a block is _ip (%r9 on
+// x86_64). Sampling that (perf record --user-regs=r9) and looking it up here
+// gives the guest code that was running. Native runs are real code and get
+// picked up by perf report directly, but they're shared between blocks, so
+// they can't say which guest code they're from.
+//
+// Blocks are named after the guest function they start in, from the symbol
+// table of the file they were mapped from, if it has one.
+
+#ifndef JIT_PERF_MAP
+#define JIT_PERF_MAP 0
+#endif
+
+bool jit_perf_map = JIT_PERF_MAP;
+
+// The symbol and string tables are read whole, and the file they come from is
+// up to the guest, so anything bigger than this is left unnamed.
+#define JIT_PERF_TABLE_MAX (16 << 20)
+
+struct jit_perf_sym {
+    dword_t offset; // in the file
+    dword_t size;
+    const char *name;
+};
+
+// Symbols of one guest file, found by its identity like in disk.c, so every
+// process mapping it shares them.
+struct jit_perf_file {
+    qword_t dev;
+    qword_t inode;
+    qword_t size;
+    dword_t mtime;
+    dword_t mtime_nsec;
+    char name[NAME_MAX + 1];
+    struct jit_perf_sym *syms;
+    size_t syms_count;
+    char *strings;
+    struct list files;
+};
+
+static struct {
+    int fd; // -1 until the first entry
+    struct list files;
+    lock_t lock;
+} jit_perf = {.fd = -1, .files = LIST_INITIALIZER(jit_perf.files)};
+
+__attribute__((constructor)) static void jit_perf_init() {
+    lock_init(&jit_perf.lock, "jit_perf\0");
+}
+
+static bool jit_perf_pread(struct fd *fd, void *buf, size_t size, off_t off) {
+    return fd->ops->pread(fd, buf, size, off) == (ssize_t) size;
+}
+
+static int jit_perf_sym_compare(const void *a, const void *b) {
+    const struct jit_perf_sym *sa = a, *sb = b;
+    return (sa->offset > sb->offset) - (sa->offset < sb->offset);
+}
+
+// Loads function symbols from the section headers, preferring the full symbol
+// table to the dynamic one. Symbols have addresses, which are turned into file
+// offsets with the program headers so that it doesn't matter where the file
+// was mapped.
+static bool jit_perf_table_ok(struct jit_perf_file *file, struct section_header *section) {
+    return section->size <= JIT_PERF_TABLE_MAX && section->offset <= file->size &&
+        section->size <= file->size - section->offset;
+}
+
+static void jit_perf_load_syms(struct jit_perf_file *file, struct fd *fd) {
+    struct elf_header header;
+    if (!jit_perf_pread(fd, &header, sizeof(header), 0) ||
+            memcmp(&header.magic, ELF_MAGIC, sizeof(header.magic)) != 0 ||
+            header.bitness != ELF_32BIT ||
+            header.phent_size != sizeof(struct prg_header) ||
+            header.shent_size != sizeof(struct section_header))
+        return;
+
+    struct prg_header *ph = calloc(header.phent_count, sizeof(*ph));
+    struct section_header *sh = calloc(header.shent_count, sizeof(*sh));
+    struct elf_sym *elf_syms = NULL;
+    if (ph == NULL || sh == NULL ||
+            !jit_perf_pread(fd, ph, header.phent_count * sizeof(*ph), header.prghead_off) ||
+            !jit_perf_pread(fd, sh, header.shent_count * sizeof(*sh), header.secthead_off))
+        goto out;
+
+    struct section_header *symtab = NULL;
+    for (unsigned i = 0; i < header.shent_count; i++) {
+        if (sh[i].type == SHT_SYMTAB || (sh[i].type == SHT_DYNSYM && symtab == NULL))
+            symtab = &sh[i];
+    }
+    if (symtab == NULL || symtab->link >= header.shent_count)
+        goto out;
+    struct section_header *strtab = &sh[symtab->link];
+    if (!jit_perf_table_ok(file, symtab) || !jit_perf_table_ok(file, strtab))
+        goto out;
+    size_t count = symtab->size / sizeof(struct elf_sym);
+    elf_syms = malloc(symtab->size);
+    file->strings = malloc(strtab->size + 1);
+    file->syms = calloc(count, sizeof(struct jit_perf_sym));
+    if (elf_syms == NULL || file->strings == NULL || file->syms == NULL ||
+            !jit_perf_pread(fd, elf_syms, symtab->size, symtab->offset) ||
+            !jit_perf_pread(fd, file->strings, strtab->size, strtab->offset))
+        goto fail;
+    file->strings[strtab->size] = '\0';
+
+    for (size_t i = 0; i < count; i++) {
+        struct elf_sym *sym = &elf_syms[i];
+        if ((sym->info & 0xf) != STT_FUNC || sym->shndx == 0 || sym->name >= strtab->size)
+            continue;
+        for (unsigned j = 0; j < header.phent_count; j++) {
+            if (ph[j].type != PT_LOAD || sym->value < ph[j].vaddr ||
+                    sym->value - ph[j].vaddr >= ph[j].filesize)
+                continue;
+            file->syms[file->syms_count++] = (struct jit_perf_sym) {
+                .offset = sym->value - ph[j].vaddr + ph[j].offset,
+                .size = sym->size,
+                .name = file->strings + sym->name,
+            };
+            break;
+        }
+    }
+    qsort(file->syms, file->syms_count, sizeof(struct jit_perf_sym), jit_perf_sym_compare);
+    goto out;
+
+fail:
+    free(file->syms);
+    free(file->strings);
+    file->syms = NULL;
+    file->strings = NULL;
+out:
+    free(ph);
+    free(sh);
+    free(elf_syms);
+}
+
+// Must be called with jit_perf.lock held
+static struct jit_perf_file *jit_perf_file_get(struct data *data) {
+    if (data->jit_perf_file != NULL)
+        return data->jit_perf_file;
+    struct fd *fd = data->fd;
+    if (fd == NULL || fd->mount == NULL || fd->ops->pread == NULL)
+        return NULL;
+    struct statbuf stat;
+    if (fd->mount->fs->fstat(fd, &stat) < 0)
+        return NULL;
+
+    struct jit_perf_file *file;
+    list_for_each_entry(&jit_perf.files, file, files) {
+        if (file->dev == stat.dev && file->inode == stat.inode && file->size == stat.size &&
+                file->mtime == stat.mtime && file->mtime_nsec == stat.mtime_nsec)
+            goto found;
+    }
+    file = calloc(1, sizeof(*file));
+    if (file == NULL)
+        return NULL;
+    file->dev = stat.dev;
+    file->inode = stat.inode;
+    file->size = stat.size;
+    file->mtime = stat.mtime;
+    file->mtime_nsec = stat.mtime_nsec;
+    char path[MAX_PATH];
+    if (generic_getpath(fd, path) >= 0) {
+        const char *slash = strrchr(path, '/');
+        const char *name = slash != NULL ? slash + 1 : path;
+        // the rest of it is already zeroed
+        memcpy(file->name, name, strnlen(name, sizeof(file->name) - 1));
+    }
+    jit_perf_load_syms(file, fd);
+    list_add(&jit_perf.files, &file->files);
+found:
+    data->jit_perf_file = file;
+    return file;
+}
+
+static struct jit_perf_sym *jit_perf_file_lookup(struct jit_perf_file *file, dword_t offset) {
+    size_t lo = 0, hi = file->syms_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (file->syms[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    struct jit_perf_sym *sym = &file->syms[lo - 1];
+    // some symbols don't have a size, give those the benefit of the doubt
+    if (sym->size != 0 && offset - sym->offset >= sym->size)
+        return NULL;
+    return sym;
+}
+
+// Must be called with jit_perf.lock held
+static void jit_perf_write(const void *code, size_t size, const char *name) {
+    if (jit_perf.fd < 0) {
+        char path[32];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        jit_perf.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (jit_perf.fd < 0) {
+            jit_perf_map = false;
+            return;
+        }
+    }
+    char line[NAME_MAX + 256];
+    int len = snprintf(line, sizeof(line), "%lx %zx %s\n", (unsigned long) code, size, name);
+    if (len > 0 && (size_t) len < sizeof(line) && write(jit_perf.fd, line, len) != len)
+        TRACE_(verbose, "%d writing perf map failed\n", current_pid());
+}
+
+void jit_perf_map_block(struct jit *jit, struct jit_block *block) {
+    char name[NAME_MAX + 128];
+    int len = block->is_trace ?
+        snprintf(name, sizeof(name), "ish trace %08x", block->addr) :
+        snprintf(name, sizeof(name), "ish %08x-%08x", block->addr, block->end_addr);
+
+    lock(&jit_perf.lock, 0);
+    struct mem *mem = container_of(jit->mmu, struct mem, mmu);
+    struct pt_entry *entry = mem_pt(mem, PAGE(block->addr));
+    struct jit_perf_file *file = entry != NULL ? jit_perf_file_get(entry->data) : NULL;
+    if (file != NULL) {
+        dword_t offset = entry->data->file_offset + entry->offset + PGOFFSET(block->addr);
+        struct jit_perf_sym *sym = jit_perf_file_lookup(file, offset);
+        if (sym != NULL)
+            len += snprintf(name + len, sizeof(name) - len, " %s+0x%x", sym->name, offset - sym->offset);
+        if (file->name[0] != '\0' && (size_t) len < sizeof(name))
+            snprintf(name + len, sizeof(name) - len, " [%s]", file->name);
+    }
+    jit_perf_write(block->code, block->used * sizeof(unsigned long), name);
+    unlock(&jit_perf.lock);
+}
+
+void jit_perf_map_native(const void *code, size_t size) {
+    lock(&jit_perf.lock, 0);
+    jit_perf_write(code, size, "ish native run");
+    unlock(&jit_perf.lock);
+}
@@ -61,6 +61,22 @@ struct prg_header {
 #define PH_W (1 << 1)
 #define PH_X (1 << 0)
 
+struct section_header {
+    uint32_t name;
+    uint32_t type;
+    dword_t flags;
+    dword_t addr;
+    dword_t offset;
+    dword_t size;
+    uint32_t link;
+    uint32_t info;
+    dword_t alignment;
+    dword_t entry_size;
+};
+
+#define SHT_SYMTAB 2
+#define SHT_DYNSYM 11
+
 struct aux_ent {
     uint32_t type;
     uint32_t value;
@@ -106,4 +122,6 @@ struct elf_sym {
     uint16_t shndx;
 };
 
+#define STT_FUNC 2
+
 #endif
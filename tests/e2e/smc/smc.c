@@ -0,0 +1,60 @@
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Writes a chain of tiny functions into an RWX page, calls it, and maps the
+// page again every so often. Each mapping gets different code at the same
+// addresses, so anything compiled from the old code, or from code that was
+// only half written, shows up as a wrong sum.
+
+#define CODE ((void *) 0x50000000)
+#define LINKS 64
+#define LINK_SIZE 16
+#define CALLS 100
+#define ROUNDS 300
+
+// xor %eax, %eax and jmp to the first link, then link i is add $value, %eax
+// and jmp to link i + 1, or ret for the last one
+static void write_code(uint8_t *code, int round) {
+    code[0] = 0x31;
+    code[1] = 0xc0;
+    code[2] = 0xeb;
+    code[3] = LINK_SIZE - 4;
+    for (int i = LINKS - 1; i >= 0; i--) {
+        sched_yield();
+        uint8_t *link = code + (i + 1) * LINK_SIZE;
+        int32_t value = round * LINKS + i;
+        link[0] = 0x05;
+        memcpy(&link[1], &value, sizeof(value));
+        if (i == LINKS - 1) {
+            link[5] = 0xc3;
+        } else {
+            int32_t offset = LINK_SIZE - 10;
+            link[5] = 0xe9;
+            memcpy(&link[6], &offset, sizeof(offset));
+        }
+    }
+}
+
+int main(void) {
+    int wrong = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        uint8_t *code = mmap(CODE, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (code == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+        write_code(code, round);
+        int expected = round * LINKS * LINKS + LINKS * (LINKS - 1) / 2;
+        for (int i = 0; i < CALLS; i++) {
+            if (((int (*)(void)) code)() != expected)
+                wrong++;
+        }
+        munmap(code, 4096);
+    }
+    printf("%d rounds, %d wrong\n", ROUNDS, wrong);
+    return 0;
+}
@@ -0,0 +1,3 @@
+#!/bin/sh
+gcc smc.c -o test_smc
+./test_smc
@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <pmmintrin.h>
+#include <tmmintrin.h>
+
+static void print_bytes(const char *name, __m128i v) {
+    uint8_t out[16];
+    _mm_storeu_si128((__m128i *) out, v);
+    printf("%s", name);
+    for (int i = 0; i < 16; i++)
+        printf(" %02x", out[i]);
+    printf("\n");
+}
+
+static void print_mm(const char *name, __m64 v) {
+    union { __m64 v; uint8_t b[8]; } out = {v};
+    printf("%s", name);
+    for (int i = 0; i < 8; i++)
+        printf(" %02x", out.b[i]);
+    printf("\n");
+}
+
+static void print_floats(const char *name, __m128 v) {
+    float out[4];
+    _mm_storeu_ps(out, v);
+    printf("%s %.2f %.2f %.2f %.2f\n", name, out[0], out[1], out[2], out[3]);
+}
+
+static void print_doubles(const char *name, __m128d v) {
+    double out[2];
+    _mm_storeu_pd(out, v);
+    printf("%s %.2f %.2f\n", name, out[0], out[1]);
+}
+
+// fisttp always truncates, no matter the rounding mode, which is round to
+// nearest here
+static void print_fisttp(long double f) {
+    int16_t w;
+    int32_t l;
+    int64_t q;
+    __asm__("fldt %1\n fisttps %0" : "=m" (w) : "m" (f));
+    __asm__("fldt %1\n fisttpl %0" : "=m" (l) : "m" (f));
+    __asm__("fldt %1\n fisttpll %0" : "=m" (q) : "m" (f));
+    printf("fisttp %d %d %lld\n", w, l, (long long) q);
+}
+
+int main(void) {
+    __m128i a = _mm_setr_epi8(0, -1, 2, -3, 4, -5, 6, -7, 8, -9, 10, -11, 12, -13, 127, -128);
+    __m128i b = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 0x80, 6, 5, 4, 3, 2, 1, 0);
+    print_bytes("pshufb", _mm_shuffle_epi8(a, b));
+    print_bytes("palignr", _mm_alignr_epi8(a, b, 5));
+    print_bytes("phaddw", _mm_hadd_epi16(a, b));
+    print_bytes("phsubsw", _mm_hsubs_epi16(a, b));
+    print_bytes("pmaddubsw", _mm_maddubs_epi16(b, a));
+    print_bytes("pmulhrsw", _mm_mulhrs_epi16(a, b));
+    print_bytes("psignb", _mm_sign_epi8(b, a));
+    print_bytes("pabsb", _mm_abs_epi8(a));
+    print_bytes("pabsd", _mm_abs_epi32(a));
+    uint8_t bytes[33];
+    for (int i = 0; i < 33; i++)
+        bytes[i] = i * 7;
+    print_bytes("lddqu", _mm_lddqu_si128((__m128i *) (bytes + 1)));
+
+    // the MMX forms, without the 66 prefix
+    __m64 ma = _mm_setr_pi8(0, -1, 2, -3, 4, -5, 127, -128);
+    __m64 mb = _mm_setr_pi8(7, 0x80, 5, 4, 3, 2, 1, 0);
+    print_mm("mm pshufb", _mm_shuffle_pi8(ma, mb));
+    print_mm("mm palignr", _mm_alignr_pi8(ma, mb, 3));
+    print_mm("mm phaddw", _mm_hadd_pi16(ma, mb));
+    print_mm("mm phsubd", _mm_hsub_pi32(ma, mb));
+    print_mm("mm pmaddubsw", _mm_maddubs_pi16(mb, ma));
+    print_mm("mm pmulhrsw", _mm_mulhrs_pi16(ma, mb));
+    print_mm("mm psignb", _mm_sign_pi8(mb, ma));
+    print_mm("mm pabsw", _mm_abs_pi16(ma));
+    _mm_empty();
+
+    __m128 x = _mm_setr_ps(1.5f, 2.25f, -3.0f, 4.0f);
+    __m128 y = _mm_setr_ps(10.0f, 20.0f, 30.0f, 40.0f);
+    print_floats("haddps", _mm_hadd_ps(x, y));
+    print_floats("hsubps", _mm_hsub_ps(x, y));
+    print_floats("addsubps", _mm_addsub_ps(x, y));
+    print_floats("movshdup", _mm_movehdup_ps(x));
+    print_floats("movsldup", _mm_moveldup_ps(x));
+
+    __m128d dx = _mm_setr_pd(1.5, -2.25);
+    __m128d dy = _mm_setr_pd(10.0, 40.0);
+    print_doubles("haddpd", _mm_hadd_pd(dx, dy));
+    print_doubles("hsubpd", _mm_hsub_pd(dx, dy));
+    print_doubles("addsubpd", _mm_addsub_pd(dx, dy));
+    print_doubles("movddup", _mm_movedup_pd(dx));
+    double d = 6.5;
+    print_doubles("movddup mem", _mm_loaddup_pd(&d));
+
+    print_fisttp(2.75L);
+    print_fisttp(-2.75L);
+    print_fisttp(1e10L);
+
+    volatile uint32_t n = 0xf00f0001;
+    printf("popcnt %d %d\n", __builtin_popcount(n), __builtin_popcount(n & 0));
+    return 0;
+}
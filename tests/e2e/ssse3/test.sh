@@ -0,0 +1,3 @@
+#!/bin/sh
+gcc -mssse3 -mpopcnt ssse3.c -o test_ssse3
+./test_ssse3
@@ -458,6 +458,21 @@ static inline int trylockw(wrlock_t *lock, __attribute__((unused)) const char *f
 
 #define trylockw(lock) trylockw(lock, __FILE__, __LINE__)
 
+// For threads that mustn't wait on a writer, like the jit's compile threads.
+// Leaves pid alone, since the thread may not have a task.
+static inline int read_trylock(wrlock_t *lock, __attribute__((unused)) const char *file, __attribute__((unused)) int line) {
+    atomic_l_lockf("r_trylock\0", __FILE__, __LINE__);
+    int status = pthread_rwlock_tryrdlock(&lock->l);
+    if(status == 0) {
+        modify_locks_held_count_wrapper(1);
+        lock->val++;
+    }
+    atomic_l_unlockf();
+    return status;
+}
+
+#define read_trylock(lock) read_trylock(lock, __FILE__, __LINE__)
+
 static inline int trylock(lock_t *lock, __attribute__((unused)) const char *file, __attribute__((unused)) int line) {
     //modify_critical_region_counter_wrapper(1,__FILE__, __LINE__);
     atomic_l_lockf("trylock\0", __FILE__, __LINE__);